@@ -0,0 +1,149 @@
+// Times GPT-J and MPT evaluation with the fused ops of g4a_ops and with the plain ggml ops they replace
+
+#include "g4a_ops.hpp"
+#include "gptj/gptj.hpp"
+#include "mpt/mpt.hpp"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <ggml.h>
+
+
+
+struct bench_result {
+    double prefill_ms = 0.0; // per token of the prompt
+    double decode_ms  = 0.0; // per generated token
+};
+
+// Evaluates n_tokens tokens after n_past ones; returns false on error
+using eval_fnc = std::function<bool (int n_past, const std::vector<int> & tokens)>;
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s model.bin [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -t N                  number of threads to evaluate with (default: all)\n");
+    fprintf(stderr, "  -p N                  number of prompt tokens evaluated as one batch (default: 128)\n");
+    fprintf(stderr, "  -n N                  number of tokens generated one at a time afterwards (default: 64)\n");
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point t_start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+// Times a prompt of n_prompt tokens, then n_gen single tokens
+static bool run(const eval_fnc & eval, int n_vocab, int n_prompt, int n_gen, bench_result & result) {
+    std::vector<int> prompt(n_prompt);
+    for (int i = 0; i < n_prompt; i++) {
+        prompt[i] = i % n_vocab;
+    }
+
+    // the first evaluation of each batch size measures its compute buffer
+    if (!eval(0, prompt) || !eval(0, {0})) {
+        return false;
+    }
+
+    auto t_start = std::chrono::steady_clock::now();
+    if (!eval(0, prompt)) {
+        return false;
+    }
+    result.prefill_ms = elapsed_ms(t_start)/n_prompt;
+
+    t_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_gen; i++) {
+        if (!eval(n_prompt + i, {i % n_vocab})) {
+            return false;
+        }
+    }
+    result.decode_ms = elapsed_ms(t_start)/std::max(n_gen, 1);
+    return true;
+}
+
+// Loads the model at fname with the fused ops enabled or not and times it
+static bool bench(const std::string & fname, bool is_mpt, bool fused, int n_threads, int n_prompt, int n_gen, bench_result & result) {
+    g4a_set_fused_ops(fused);
+
+    auto fin = std::ifstream(fname, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname.c_str());
+        return false;
+    }
+
+    gpt_vocab vocab;
+    std::vector<float> logits;
+    const int n_ctx = n_prompt + n_gen;
+    if (is_mpt) {
+        auto model = std::make_unique<mpt_model>();
+        if (!mpt_model_load(fname, fin, *model, vocab, n_ctx)) {
+            return false;
+        }
+        return run([&] (int n_past, const std::vector<int> & tokens) {
+            return mpt_eval(*model, n_threads, n_past, tokens, logits);
+        }, model->hparams.n_vocab, n_prompt, n_gen, result);
+    } else {
+        auto model = std::make_unique<gptj_model>();
+        if (!gptj_model_load(fname, fin, *model, vocab, n_ctx)) {
+            return false;
+        }
+        return run([&] (int n_past, const std::vector<int> & tokens) {
+            return gptj_eval(*model, n_threads, n_past, tokens, logits);
+        }, model->hparams.n_vocab, n_prompt, n_gen, result);
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    int n_prompt = 128;
+    int n_gen = 64;
+    for (int i = 2; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc) {
+            n_threads = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-p" && i + 1 < argc) {
+            n_prompt = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-n" && i + 1 < argc) {
+            n_gen = std::max(0, std::stoi(argv[++i]));
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // the model type is told apart by the magic, like justlm does
+    uint32_t magic = 0;
+    {
+        auto fin = std::ifstream(fname, std::ios::binary);
+        fin.read((char *) &magic, sizeof(magic));
+    }
+    const bool is_mpt = magic == 0x67676d6d;
+    if (magic != 0x67676d6c && !is_mpt) {
+        fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname.c_str());
+        return 1;
+    }
+
+    bench_result plain, fused;
+    if (!bench(fname, is_mpt, false, n_threads, n_prompt, n_gen, plain) || !bench(fname, is_mpt, true, n_threads, n_prompt, n_gen, fused)) {
+        fprintf(stderr, "%s: failed to evaluate '%s'\n", __func__, fname.c_str());
+        return 1;
+    }
+
+    printf("\n%s model, %d threads\n", is_mpt ? "MPT" : "GPT-J", n_threads);
+    printf("%-8s %16s %16s\n", "ops", "prefill ms/tok", "decode ms/tok");
+    printf("%-8s %16.3f %16.3f\n", "plain", plain.prefill_ms, plain.decode_ms);
+    printf("%-8s %16.3f %16.3f\n", "fused", fused.prefill_ms, fused.decode_ms);
+    printf("%-8s %15.2fx %15.2fx\n", "speedup", plain.prefill_ms/fused.prefill_ms, n_gen ? plain.decode_ms/fused.decode_ms : 0.0);
+    return 0;
+}
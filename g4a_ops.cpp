@@ -0,0 +1,999 @@
+#include "g4a_ops.hpp"
+#include "justlm_compute.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+
+#ifndef _WIN32
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#   define G4A_VNNI
+#   include <immintrin.h>
+#endif
+
+// BLAS as configured for ggml by llama.cpp.cmake
+#if defined(GGML_USE_ACCELERATE)
+#   define G4A_BLAS
+#   include <Accelerate/Accelerate.h>
+#elif defined(GGML_USE_OPENBLAS)
+#   define G4A_BLAS
+#   include <cblas.h>
+#endif
+
+
+ggml_type g4a_ftype_to_type(int32_t ftype) {
+    switch (ftype) {
+        case 0: return GGML_TYPE_F32;
+        case 1: return GGML_TYPE_F16;
+        case 2: return GGML_TYPE_Q4_0;
+        case 3: return GGML_TYPE_Q4_1;
+        case 5: return GGML_TYPE_Q4_2;
+        case 7: return GGML_TYPE_Q8_0;
+        case 8: return GGML_TYPE_Q5_0;
+        case 9: return GGML_TYPE_Q5_1;
+        default: return GGML_TYPE_COUNT;
+    }
+}
+
+int32_t g4a_type_to_ftype(ggml_type type) {
+    for (int32_t ftype = 0; ftype != 10; ftype++) {
+        if (g4a_ftype_to_type(ftype) == type) return ftype;
+    }
+    return -1;
+}
+
+bool g4a_tensor_type_valid(int32_t type, int64_t row_length) {
+    switch (type) {
+        case GGML_TYPE_F32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q4_2:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+            return row_length % ggml_blck_size(ggml_type(type)) == 0;
+        default:
+            return false;
+    }
+}
+
+size_t g4a_row_size(ggml_type type, int64_t n) {
+    assert(n % ggml_blck_size(type) == 0);
+    return ggml_type_size(type)*(n/ggml_blck_size(type));
+}
+
+void g4a_convert_row(ggml_type src_type, const void * src, ggml_type dst_type, void * dst, int64_t n) {
+    if (src_type == dst_type) {
+        memcpy(dst, src, g4a_row_size(src_type, n));
+        return;
+    }
+
+    // through F32, dequantizing directly into dst if that's F32
+    thread_local std::vector<float> buf;
+    const float * values = (const float *) src;
+    if (src_type != GGML_TYPE_F32) {
+        float * out = (float *) dst;
+        if (dst_type != GGML_TYPE_F32) {
+            buf.resize(n);
+            out = buf.data();
+        }
+        if (src_type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, out, n);
+        } else {
+            ggml_internal_get_quantize_fn(src_type).dequantize_row_q(src, out, n);
+        }
+        if (dst_type == GGML_TYPE_F32) {
+            return;
+        }
+        values = out;
+    }
+
+    if (dst_type == GGML_TYPE_F16) {
+        ggml_fp32_to_fp16_row(values, (ggml_fp16_t *) dst, n);
+    } else {
+        ggml_internal_get_quantize_fn(dst_type).quantize_row_q(values, dst, n);
+    }
+}
+
+bool g4a_read_tensor_infos(std::istream & fin, std::map<std::string, g4a_tensor_info> & infos) {
+    const auto start = fin.tellg();
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+        fin.read(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
+
+        if (fin.eof()) {
+            break;
+        }
+
+        if (n_dims < 1 || n_dims > 2 || length <= 0) {
+            return false;
+        }
+
+        int64_t nelements = 1;
+        int32_t ne[2] = { 1, 1 };
+        for (int i = 0; i < n_dims; ++i) {
+            fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+            nelements *= ne[i];
+        }
+
+        std::string name(length, 0);
+        fin.read(&name[0], length);
+
+        if (!fin || !g4a_tensor_type_valid(ttype, ne[0])) {
+            return false;
+        }
+
+        const size_t nbytes = nelements*ggml_type_size(ggml_type(ttype))/ggml_blck_size(ggml_type(ttype));
+        infos[name] = {ggml_type(ttype), nbytes, size_t(fin.tellg())};
+
+        fin.seekg(nbytes, std::ios::cur);
+    }
+
+    fin.clear();
+    fin.seekg(start);
+    return bool(fin);
+}
+
+
+bool g4a_mmap_offset_valid(ggml_type type, size_t offset) {
+    // elements are F32 or F16, and blocks start with F32 or F16 scales; the sizes of blocks with F32 scales are multiples of 4
+    const size_t align = ggml_type_size(type) % 4 == 0 ? 4 : 2;
+    return offset % align == 0;
+}
+
+g4a_mmap::~g4a_mmap() {
+#ifndef _WIN32
+    if (addr_) {
+        munmap(addr_, size_);
+    }
+#endif
+}
+
+bool g4a_mmap::map(const std::string & fname, bool populate) {
+#ifndef _WIN32
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (populate) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+#ifndef MAP_POPULATE
+    if (populate) {
+        posix_madvise(addr, st.st_size, POSIX_MADV_WILLNEED);
+    }
+#endif
+
+    addr_ = (uint8_t *) addr;
+    size_ = st.st_size;
+    return true;
+#else
+    (void) fname;
+    (void) populate;
+    return false;
+#endif
+}
+
+bool g4a_mlock(const void * addr, size_t size) {
+#ifndef _WIN32
+    if (mlock(addr, size) == 0) {
+        return true;
+    }
+    fprintf(stderr, "%s: failed to lock %.2f MB into memory: %s; the limit can be raised with ulimit -l\n", __func__, size/1024.0/1024.0, strerror(errno));
+#else
+    (void) addr;
+    fprintf(stderr, "%s: failed to lock %.2f MB into memory: not supported on this platform\n", __func__, size/1024.0/1024.0);
+#endif
+    return false;
+}
+
+
+// Chunk size parallel reads are split into; large enough for sequential throughput per stream
+static constexpr size_t read_chunk_size = 16*1024*1024;
+
+bool g4a_read_tensors(const std::string & fname, const std::vector<g4a_read_job> & jobs, int n_threads, const g4a_load_progress & progress) {
+    // Split jobs into chunks
+    std::vector<g4a_read_job> chunks;
+    size_t total = 0;
+    for (const auto & job : jobs) {
+        for (size_t i = 0; i < job.nbytes; i += read_chunk_size) {
+            chunks.push_back({job.offset + i, std::min(read_chunk_size, job.nbytes - i), static_cast<uint8_t *>(job.dst) + i});
+        }
+        total += job.nbytes;
+    }
+    n_threads = std::max(1, std::min(n_threads, int(chunks.size())));
+
+    std::atomic<size_t> next_chunk(0);
+    std::atomic<bool> stop(false);
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t n_done = 0;
+    size_t bytes_done = 0;
+    int n_running = n_threads;
+    bool failed = false;
+
+    // Every worker takes the next chunk till there are none left
+    const auto work = [&] () {
+        std::ifstream fin(fname, std::ios::binary);
+        while (!stop) {
+            const size_t i = next_chunk++;
+            if (i >= chunks.size()) {
+                break;
+            }
+            const auto & chunk = chunks[i];
+            fin.seekg(chunk.offset);
+            fin.read(static_cast<char *>(chunk.dst), chunk.nbytes);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!fin) {
+                failed = true;
+                stop = true;
+            }
+            n_done++;
+            bytes_done += chunk.nbytes;
+            cv.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        n_running--;
+        cv.notify_one();
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_threads; i++) {
+        workers.emplace_back(work);
+    }
+
+    // Report progress whenever chunks were completed
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        size_t n_reported = 0;
+        while (true) {
+            cv.wait(lock, [&] () { return n_done != n_reported || !n_running; });
+            if (n_done == n_reported || stop) {
+                if (!n_running) {
+                    break;
+                }
+                n_reported = n_done;
+                continue;
+            }
+            n_reported = n_done;
+            const float share = total ? bytes_done*100.f/total : 100.f;
+            if (progress) {
+                lock.unlock();
+                const bool go_on = progress(share);
+                lock.lock();
+                if (!go_on) {
+                    stop = true;
+                }
+            }
+        }
+    }
+
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    if (failed) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+    if (stop) {
+        return false;
+    }
+    // Nothing to read still completes loading
+    if (chunks.empty() && progress) {
+        return progress(100.f);
+    }
+    return true;
+}
+
+
+// Runs fnc(ith, nth) on n_threads threads: the calling one and persistent workers of the shared compute pool
+template<typename Fnc>
+static void parallel_run(int n_threads, const Fnc & fnc) {
+    LM::ComputePool::get().run_parallel(std::max(n_threads, 1), [&] (unsigned ith, unsigned nth) {
+        fnc(int(ith), int(nth));
+    });
+}
+
+
+// Matches ggml_norm
+static constexpr float norm_eps = 1e-5f;
+
+// Computes mean and inverse standard deviation of a row like ggml_norm
+static void norm_stats(const int n, const float * x, float & mean, float & scale) {
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += x[i];
+    }
+    mean = sum/n;
+
+    double sum2 = 0.0;
+    for (int i = 0; i < n; i++) {
+        const float v = x[i] - mean;
+        sum2 += v*v;
+    }
+    scale = 1.0f/sqrtf(sum2/n + norm_eps);
+}
+
+static void op_norm_scale(const int n, float * dst, const float * x, const float * w) {
+    float mean, scale;
+    norm_stats(n, x, mean, scale);
+    for (int i = 0; i < n; i++) {
+        dst[i] = (x[i] - mean)*scale*w[i];
+    }
+}
+
+static void op_norm_scale_bias(const int n, float * dst, const float * x, const float * wb) {
+    // Bias directly follows the weights
+    const float * b = wb + n;
+    float mean, scale;
+    norm_stats(n, x, mean, scale);
+    for (int i = 0; i < n; i++) {
+        dst[i] = (x[i] - mean)*scale*wb[i] + b[i];
+    }
+}
+
+static void op_add_bias(const int n, float * dst, const float * x, const float * b) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = x[i] + b[i];
+    }
+}
+
+// Same precision as ggml's GELU, which looks results up in a table indexed by the fp16 input
+static const std::vector<float>& get_gelu_table() {
+    static const std::vector<float> table = [] () {
+        const float gelu_coef_a = 0.044715f;
+        const float sqrt_2_over_pi = 0.79788456080286535587989211986876f;
+        std::vector<float> fres(1 << 16);
+        for (unsigned i = 0; i != fres.size(); i++) {
+            const float x = ggml_fp16_to_fp32(ggml_fp16_t(i));
+            const float y = 0.5f*x*(1.0f + tanhf(sqrt_2_over_pi*x*(1.0f + gelu_coef_a*x*x)));
+            fres[i] = ggml_fp16_to_fp32(ggml_fp32_to_fp16(y));
+        }
+        return fres;
+    }();
+    return table;
+}
+
+static void op_add_bias_gelu(const int n, float * dst, const float * x, const float * b) {
+    const float * table = get_gelu_table().data();
+    for (int i = 0; i < n; i++) {
+        dst[i] = table[ggml_fp32_to_fp16(x[i] + b[i])];
+    }
+}
+
+
+// Whether the fused ops are built as such or from plain ggml ops
+static bool fused_ops = true;
+
+void g4a_set_fused_ops(bool enabled) {
+    fused_ops = enabled;
+}
+
+// Adds an op computing fnc(n, dst row, x row, p) for every row of x, with the rows split into one chunk per thread
+static struct ggml_tensor * map_rows(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * p,
+                                     void (*fnc)(const int n, float * dst, const float * x, const float * p)) {
+    assert(x->type == GGML_TYPE_F32 && p->type == GGML_TYPE_F32 && p->ne[0] == x->ne[0]);
+    assert(x->nb[0] == sizeof(float) && x->ne[2] == 1 && x->ne[3] == 1);
+
+    struct ggml_tensor * out = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, x->ne[0], x->ne[1]);
+
+    ggml_build_forward_expand(&gf, x);
+    g4a_graph_add_op(gf, ops, [x, p, out, fnc] (int n_threads) {
+        const int n = x->ne[0];
+        const int n_rows = x->ne[1];
+        parallel_run(std::min(n_threads, n_rows), [&] (int ith, int nth) {
+            for (int r = n_rows*ith/nth; r < n_rows*(ith + 1)/nth; r++) {
+                fnc(n, (float *) ((char *) out->data + r*out->nb[1]), (const float *) ((const char *) x->data + r*x->nb[1]), (const float *) p->data);
+            }
+        });
+    });
+    return out;
+}
+
+struct ggml_tensor * g4a_norm_affine(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * w, struct ggml_tensor * b) {
+    if (!fused_ops) {
+        struct ggml_tensor * cur = ggml_norm(ctx, x);
+        cur = ggml_mul(ctx, ggml_repeat(ctx, w, cur), cur);
+        return b ? ggml_add(ctx, ggml_repeat(ctx, b, cur), cur) : cur;
+    }
+    if (!b) {
+        return map_rows(ctx, gf, ops, x, w, op_norm_scale);
+    }
+    assert(ggml_nelements(b) == ggml_nelements(w));
+    assert((char *) b->data == (char *) w->data + ggml_nbytes(w));
+    return map_rows(ctx, gf, ops, x, w, op_norm_scale_bias);
+}
+
+struct ggml_tensor * g4a_add_bias(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * b) {
+    if (!fused_ops) {
+        return ggml_add(ctx, ggml_repeat(ctx, b, x), x);
+    }
+    return map_rows(ctx, gf, ops, x, b, op_add_bias);
+}
+
+struct ggml_tensor * g4a_add_bias_gelu(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * b) {
+    if (!fused_ops) {
+        return ggml_gelu(ctx, ggml_add(ctx, ggml_repeat(ctx, b, x), x));
+    }
+    get_gelu_table(); // Build table before graph computation
+    return map_rows(ctx, gf, ops, x, b, op_add_bias_gelu);
+}
+
+
+void g4a_graph_add_op(const struct ggml_cgraph & gf, g4a_graph_ops & ops, std::function<void (int n_threads)> compute) {
+    ops.push_back({gf.n_nodes, std::move(compute)});
+}
+
+g4a_graph_pos g4a_graph_position(const struct ggml_cgraph & gf, const g4a_graph_ops & ops) {
+    return {gf.n_nodes, ops.size()};
+}
+
+size_t g4a_graph_work_size(const struct ggml_cgraph & gf, int n_threads) {
+    size_t fres = 0;
+    for (int i = 0; i < gf.n_nodes; i++) {
+        const struct ggml_tensor * node = gf.nodes[i];
+        if (node->op != GGML_OP_MUL_MAT || node->src0->type == GGML_TYPE_F32) continue;
+        // src1 converted to the vector dot type of src0, never larger than F32
+        size_t cur = ggml_nelements(node->src1)*sizeof(float);
+        // src0 dequantized to F32 for BLAS, which ggml uses from 32 rows on
+        if (ggml_cpu_has_blas() && node->src1->ne[1] >= 32) {
+            cur = std::max<size_t>(cur, node->src0->ne[0]*node->src0->ne[1]*sizeof(float));
+        }
+        fres = std::max(fres, cur);
+    }
+    // cache line padding per thread
+    return fres + 64*n_threads;
+}
+
+struct ggml_tensor * g4a_graph_work(size_t size) {
+    thread_local std::vector<uint8_t> buf;
+    thread_local struct ggml_tensor work = {};
+
+    if (buf.size() < size) {
+        buf.resize(size);
+    }
+
+    // a plain I8 tensor; ggml only reads the data pointer and the size of it
+    work.type  = GGML_TYPE_I8;
+    work.n_dims = 1;
+    work.ne[0] = buf.size();
+    work.ne[1] = work.ne[2] = work.ne[3] = 1;
+    work.nb[0] = 1;
+    work.nb[1] = work.nb[2] = work.nb[3] = buf.size();
+    work.data  = buf.data();
+    return &work;
+}
+
+void g4a_graph_compute_nodes(struct ggml_context * ctx, const struct ggml_cgraph & gf, struct ggml_cgraph & graph, int begin, int end, int n_threads, struct ggml_tensor * work) {
+    graph.n_nodes   = end - begin;
+    graph.n_leafs   = 0;
+    graph.n_threads = n_threads;
+    graph.work_size = ggml_nbytes(work);
+    graph.work      = work;
+    std::copy(gf.nodes + begin, gf.nodes + end, graph.nodes);
+    ggml_graph_compute(ctx, &graph);
+}
+
+void g4a_graph_compute_range(struct ggml_context * ctx, const struct ggml_cgraph & gf, const g4a_graph_ops & ops, struct ggml_cgraph & graph, g4a_graph_pos begin, g4a_graph_pos end, int n_threads, struct ggml_tensor * work) {
+    int node = begin.node;
+    for (size_t op = begin.op; op != end.op; op++) {
+        if (node != ops[op].node) {
+            g4a_graph_compute_nodes(ctx, gf, graph, node, ops[op].node, n_threads, work);
+            node = ops[op].node;
+        }
+        ops[op].compute(n_threads);
+    }
+    if (node != end.node) {
+        g4a_graph_compute_nodes(ctx, gf, graph, node, end.node, n_threads, work);
+    }
+}
+
+void g4a_graph_compute(struct ggml_context * ctx, struct ggml_cgraph & gf, const g4a_graph_ops & ops, int n_threads) {
+    struct ggml_tensor * work = g4a_graph_work(g4a_graph_work_size(gf, n_threads));
+
+    if (ops.empty()) {
+        gf.n_threads = n_threads;
+        gf.work_size = ggml_nbytes(work);
+        gf.work      = work;
+        ggml_graph_compute(ctx, &gf);
+        return;
+    }
+
+    auto graph = std::make_unique<ggml_cgraph>();
+    g4a_graph_compute_range(ctx, gf, ops, *graph, {0, 0}, g4a_graph_position(gf, ops), n_threads, work);
+}
+
+
+struct ggml_tensor * g4a_cpy(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * dst) {
+    if (ggml_blck_size(dst->type) == 1) {
+        return ggml_cpy(ctx, x, dst);
+    }
+
+    // quantized in one go, which needs both to be contiguous
+    assert(x->type == GGML_TYPE_F32 && ggml_nelements(x) == ggml_nelements(dst));
+    assert(ggml_nbytes(x) == g4a_row_size(x->type, ggml_nelements(x)) && ggml_nbytes(dst) == g4a_row_size(dst->type, ggml_nelements(dst)));
+
+    ggml_build_forward_expand(&gf, x);
+    g4a_graph_add_op(gf, ops, [x, dst] (int) {
+        g4a_convert_row(GGML_TYPE_F32, x->data, dst->type, dst->data, ggml_nelements(x));
+    });
+    return dst;
+}
+
+void g4a_set_n_past(struct ggml_tensor * node, int n_past) {
+    // stored as first parameter in src1 by this ggml
+    ((int32_t *) node->src1->data)[0] = n_past;
+}
+
+void g4a_set_ne(struct ggml_tensor * t, int dim, int64_t ne) {
+    t->ne[dim] = ne;
+    for (int i = dim + 1; i < GGML_MAX_DIMS; i++) {
+        // rows of quantized tensors are made of blocks
+        t->nb[i] = i == 1 ? g4a_row_size(t->type, t->ne[0]) : t->nb[i - 1]*t->ne[i - 1];
+    }
+}
+
+
+size_t g4a_compute_buf_size(int N, const std::function<size_t (int n)> & measure) {
+    // graphs of up to this many tokens are measured directly
+    constexpr int n_measured = 6;
+    if (N <= n_measured) {
+        return measure(N);
+    }
+
+    // every tensor grows linearly with the number of tokens, by a multiple of 4 bytes per token for F32, I32 and the
+    // quantized activations; in steps of 4 tokens that is a multiple of ggml's 16 byte alignment, so the sizes of graphs
+    // 4 tokens apart are exactly linear. N is rounded up to such a step
+    const size_t size_first = measure(n_measured - 4);
+    const size_t size_last  = measure(n_measured);
+    const size_t n_steps = (N - (n_measured - 4) + 3)/4;
+    return size_first + n_steps*(size_last - size_first);
+}
+
+
+// Idle buffers by size
+static std::mutex compute_buffers_mutex;
+static std::multimap<size_t, std::unique_ptr<uint8_t[]>> compute_buffers_idle;
+
+// Buffers kept idle at most; the smallest ones are freed first
+static constexpr size_t compute_buffers_idle_max = 8;
+
+g4a_compute_buffer::g4a_compute_buffer(size_t size) {
+    {
+        std::scoped_lock L(compute_buffers_mutex);
+        // don't waste buffers that are more than twice as large
+        const auto res = compute_buffers_idle.lower_bound(size);
+        if (res != compute_buffers_idle.end() && res->first <= 2*size) {
+            addr_ = res->second.release();
+            size_ = res->first;
+            compute_buffers_idle.erase(res);
+            return;
+        }
+    }
+    addr_ = new uint8_t[size];
+    size_ = size;
+}
+
+g4a_compute_buffer::~g4a_compute_buffer() {
+    std::scoped_lock L(compute_buffers_mutex);
+    compute_buffers_idle.emplace(size_, std::unique_ptr<uint8_t[]>(addr_));
+    if (compute_buffers_idle.size() > compute_buffers_idle_max) {
+        compute_buffers_idle.erase(compute_buffers_idle.begin());
+    }
+}
+
+
+// Rows interleaved per group and values per block; both Q4_0 and Q8_0 use blocks of 32
+static constexpr int repack_rows = 16;
+static constexpr int repack_blck = 32;
+
+// Bytes of quantized values per block; the rest is its scale, either F32 or F16 depending on the ggml version
+static size_t repack_quant_size(ggml_type type) {
+    return type == GGML_TYPE_Q4_0 ? repack_blck/2 : repack_blck;
+}
+
+#ifdef G4A_VNNI
+// Activations quantized to 8 bits per block like Q8_0, plus the sum of the quantized values
+struct block_x8 {
+    float   d;
+    int32_t sum;
+    int8_t  qs[repack_blck];
+};
+
+static void quantize_row_x8(const float * x, block_x8 * y, int64_t nb) {
+    for (int64_t b = 0; b < nb; b++) {
+        float amax = 0.0f;
+        for (int i = 0; i < repack_blck; i++) {
+            amax = std::max(amax, fabsf(x[i]));
+        }
+
+        const float d  = amax/127.0f;
+        const float id = d ? 1.0f/d : 0.0f;
+
+        int32_t sum = 0;
+        for (int i = 0; i < repack_blck; i++) {
+            const int8_t q = roundf(x[i]*id);
+            y[b].qs[i] = q;
+            sum += q;
+        }
+        y[b].d   = d;
+        y[b].sum = sum;
+
+        x += repack_blck;
+    }
+}
+
+// Computes rows [16*g_begin, 16*g_end) of y = w*x for the N rows of x
+// Weights are unsigned (offset by 8 for Q4_0, 128 for Q8_0) so vpdpbusd can multiply them with the signed activations;
+// the offset times the sum of the activations is subtracted afterwards
+__attribute__((target("avx512f,avx512bw,avx512vnni,f16c,fma")))
+static void mul_mat_vnni(const struct ggml_tensor * w, const block_x8 * x, int N, float * y, int64_t g_begin, int64_t g_end) {
+    const bool is_q4 = w->type == GGML_TYPE_Q4_0;
+    const int64_t nb = w->ne[0]/repack_blck;
+    const int64_t n_out = w->ne[1];
+    const size_t group_size = repack_rows*ggml_type_size(w->type);
+    const size_t scale_size = ggml_type_size(w->type) - repack_quant_size(w->type);
+    const int32_t offset = is_q4 ? 8 : 128;
+
+    // tokens are processed in tiles, so each block of weights is loaded and unpacked once per tile
+    constexpr int n_tile = 4;
+
+    const __m512i mask_lo = _mm512_set1_epi8(0x0F);
+
+    for (int64_t g = g_begin; g < g_end; g++) {
+        const uint8_t * wg = (const uint8_t *) w->data + g*nb*group_size;
+
+        for (int t0 = 0; t0 < N; t0 += n_tile) {
+            const int nt = std::min(n_tile, N - t0);
+
+            __m512 acc[n_tile];
+            for (int t = 0; t < n_tile; t++) {
+                acc[t] = _mm512_setzero_ps();
+            }
+
+            for (int64_t b = 0; b < nb; b++) {
+                const uint8_t * wb = wg + b*group_size;
+                const __m512 scales = scale_size == sizeof(float) ? _mm512_loadu_ps(wb)
+                                                                  : _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *) wb));
+                const uint8_t * qs = wb + repack_rows*scale_size;
+
+                // 4 consecutive values of each of the 16 rows per vector
+                __m512i wq[8];
+                if (is_q4) {
+                    for (int s = 0; s < 4; s++) {
+                        const __m512i v = _mm512_loadu_si512(qs + s*64);
+                        wq[2*s]     = _mm512_and_si512(v, mask_lo);
+                        wq[2*s + 1] = _mm512_and_si512(_mm512_srli_epi16(v, 4), mask_lo);
+                    }
+                } else {
+                    for (int s = 0; s < 8; s++) {
+                        wq[s] = _mm512_loadu_si512(qs + s*64);
+                    }
+                }
+
+                for (int t = 0; t < nt; t++) {
+                    const block_x8 & xb = x[(t0 + t)*nb + b];
+
+                    __m512i isum = _mm512_setzero_si512();
+                    for (int s = 0; s < 8; s++) {
+                        // Q4_0 holds values 4s..4s+3 of each 8 in the low nibbles and the next 4 in the high ones
+                        const int i = is_q4 ? (s/2)*8 + (s%2)*4 : s*4;
+                        int32_t xq;
+                        memcpy(&xq, xb.qs + i, sizeof(xq));
+                        isum = _mm512_dpbusd_epi32(isum, wq[s], _mm512_set1_epi32(xq));
+                    }
+                    isum = _mm512_sub_epi32(isum, _mm512_set1_epi32(offset*xb.sum));
+
+                    acc[t] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(isum), _mm512_mul_ps(scales, _mm512_set1_ps(xb.d)), acc[t]);
+                }
+            }
+
+            for (int t = 0; t < nt; t++) {
+                _mm512_storeu_ps(y + (t0 + t)*n_out + g*repack_rows, acc[t]);
+            }
+        }
+    }
+}
+#endif
+
+bool g4a_repack_supported(const struct ggml_tensor * w) {
+#ifdef G4A_VNNI
+    static const bool cpu_supported = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                                      __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("f16c") &&
+                                      __builtin_cpu_supports("fma");
+    if (!cpu_supported) return false;
+    if (w->type != GGML_TYPE_Q4_0 && w->type != GGML_TYPE_Q8_0) return false;
+    // scales are either F32 or F16
+    const size_t scale_size = ggml_type_size(w->type) - repack_quant_size(w->type);
+    if (scale_size != sizeof(float) && scale_size != sizeof(ggml_fp16_t)) return false;
+    return w->ne[2] == 1 && w->ne[3] == 1 && w->ne[0] % repack_blck == 0 && w->ne[1] % repack_rows == 0 &&
+           w->nb[1] == w->ne[0]/repack_blck*ggml_type_size(w->type);
+#else
+    (void) w;
+    return false;
+#endif
+}
+
+void g4a_repack(struct ggml_tensor * w, int n_threads) {
+    assert(g4a_repack_supported(w));
+
+    const bool is_q4 = w->type == GGML_TYPE_Q4_0;
+    const int64_t nb = w->ne[0]/repack_blck;
+    const int64_t n_groups = w->ne[1]/repack_rows;
+    const size_t type_size = ggml_type_size(w->type);
+    const size_t scale_size = type_size - repack_quant_size(w->type);
+    const size_t group_size = repack_rows*type_size;
+    const auto dequantize = ggml_internal_get_quantize_fn(w->type).dequantize_row_q;
+
+    parallel_run(n_threads, [&] (int ith, int nth) {
+        // the rows of a group occupy the same memory before and after repacking
+        std::vector<uint8_t> rows(nb*group_size);
+        float values[repack_blck];
+        int quants[repack_blck];
+
+        for (int64_t g = ith; g < n_groups; g += nth) {
+            uint8_t * data = (uint8_t *) w->data + g*nb*group_size;
+            memcpy(rows.data(), data, rows.size());
+
+            for (int64_t b = 0; b < nb; b++) {
+                uint8_t * dst = data + b*group_size;
+                uint8_t * qs  = dst + repack_rows*scale_size;
+
+                for (int r = 0; r < repack_rows; r++) {
+                    const uint8_t * src = rows.data() + (r*nb + b)*type_size;
+
+                    // the scale leads each block; the quantized values are recovered through ggml,
+                    // which avoids depending on how this version of ggml orders them
+                    const float d = scale_size == sizeof(float) ? *(const float *) src : ggml_fp16_to_fp32(*(const ggml_fp16_t *) src);
+                    const float id = d ? 1.0f/d : 0.0f;
+                    dequantize(src, values, repack_blck);
+                    for (int i = 0; i < repack_blck; i++) {
+                        quants[i] = int(roundf(values[i]*id)) + (is_q4 ? 8 : 128);
+                    }
+
+                    memcpy(dst + r*scale_size, src, scale_size);
+                    for (int s = 0; s < (is_q4 ? 4 : 8); s++) {
+                        for (int j = 0; j < 4; j++) {
+                            qs[s*64 + r*4 + j] = is_q4 ? quants[s*8 + j] | (quants[s*8 + 4 + j] << 4) : quants[s*4 + j];
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Dequantizes rows [r_begin, r_end) of w
+static void dequantize_rows(const struct ggml_tensor * w, bool repacked, int64_t r_begin, int64_t r_end, float * dst) {
+    const int64_t n_per_row = w->ne[0];
+
+    if (!repacked) {
+        for (int64_t r = r_begin; r < r_end; r++) {
+            const void * row = (const char *) w->data + r*w->nb[1];
+            float * out = dst + (r - r_begin)*n_per_row;
+            if (w->type == GGML_TYPE_F32) {
+                memcpy(out, row, n_per_row*sizeof(float));
+            } else if (w->type == GGML_TYPE_F16) {
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *) row, out, n_per_row);
+            } else {
+                ggml_internal_get_quantize_fn(w->type).dequantize_row_q(row, out, n_per_row);
+            }
+        }
+        return;
+    }
+
+    const bool is_q4 = w->type == GGML_TYPE_Q4_0;
+    const int64_t nb = n_per_row/repack_blck;
+    const size_t group_size = repack_rows*ggml_type_size(w->type);
+    const size_t scale_size = ggml_type_size(w->type) - repack_quant_size(w->type);
+
+    for (int64_t g = r_begin/repack_rows; g*repack_rows < r_end; g++) {
+        // the range may start or end within a group
+        const int r0 = std::max<int64_t>(0, r_begin - g*repack_rows);
+        const int r1 = std::min<int64_t>(repack_rows, r_end - g*repack_rows);
+
+        for (int64_t b = 0; b < nb; b++) {
+            const uint8_t * wb = (const uint8_t *) w->data + (g*nb + b)*group_size;
+            const uint8_t * qs = wb + repack_rows*scale_size;
+
+            for (int r = r0; r < r1; r++) {
+                const float d = scale_size == sizeof(float) ? *(const float *) (wb + r*scale_size) : ggml_fp16_to_fp32(*(const ggml_fp16_t *) (wb + r*scale_size));
+                float * out = dst + (g*repack_rows + r - r_begin)*n_per_row + b*repack_blck;
+
+                for (int s = 0; s < (is_q4 ? 4 : 8); s++) {
+                    for (int j = 0; j < 4; j++) {
+                        const uint8_t q = qs[s*64 + r*4 + j];
+                        if (is_q4) {
+                            out[s*8 + j]     = d*(int(q & 0x0F) - 8);
+                            out[s*8 + 4 + j] = d*(int(q >> 4) - 8);
+                        } else {
+                            out[s*4 + j] = d*(int(q) - 128);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+#ifdef G4A_BLAS
+// Batches from this many rows on are multiplied by BLAS, like ggml does
+static constexpr int blas_min_batch = 32;
+
+// Dequantized weights are multiplied in chunks of up to this many values to keep the scratch buffer small
+static constexpr int64_t blas_chunk_size = 4*1024*1024;
+
+// y = w*x through BLAS, dequantizing w chunk by chunk into a per thread scratch buffer that is reused across calls
+static void mul_mat_blas(const struct ggml_tensor * w, bool repacked, const struct ggml_tensor * x, struct ggml_tensor * y, int n_threads) {
+    static thread_local std::vector<float> scratch;
+
+    const int N = x->ne[1];
+    const int64_t n_per_row = w->ne[0];
+    const int64_t n_rows = w->ne[1];
+    const int64_t n_chunk_rows = std::min(n_rows, std::max<int64_t>(repack_rows, blas_chunk_size/n_per_row/repack_rows*repack_rows));
+    scratch.resize(n_chunk_rows*n_per_row);
+    float * buf = scratch.data(); // thread_local isn't shared with the workers
+
+    for (int64_t r0 = 0; r0 < n_rows; r0 += n_chunk_rows) {
+        const int64_t nr = std::min(n_chunk_rows, n_rows - r0);
+
+        // groups of 16 rows per thread, so repacked weights are never split
+        const int64_t n_groups = (nr + repack_rows - 1)/repack_rows;
+        parallel_run(std::min<int64_t>(n_threads, n_groups), [&] (int ith, int nth) {
+            const int64_t begin = std::min(nr, n_groups*ith/nth*repack_rows);
+            const int64_t end   = std::min(nr, n_groups*(ith + 1)/nth*repack_rows);
+            dequantize_rows(w, repacked, r0 + begin, r0 + end, buf + begin*n_per_row);
+        });
+
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                    N, nr, n_per_row,
+                    1.0f, (const float *) x->data, n_per_row,
+                          buf, n_per_row,
+                    0.0f, (float *) y->data + r0, n_rows);
+    }
+}
+#endif
+
+struct ggml_tensor * g4a_mul_mat(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * w, struct ggml_tensor * x, bool repacked) {
+    repacked = repacked && g4a_repack_supported(w);
+
+    const int N = x->ne[1];
+
+#ifdef G4A_BLAS
+    // F32 weights are multiplied by BLAS without dequantization in ggml already
+    if (N >= blas_min_batch && w->type != GGML_TYPE_F32) {
+        assert(x->type == GGML_TYPE_F32 && x->nb[1] == x->ne[0]*sizeof(float) && x->ne[2] == 1 && x->ne[3] == 1);
+        assert(w->nb[1] == ggml_nbytes(w)/w->ne[1]);
+
+        struct ggml_tensor * out = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, w->ne[1], N);
+
+        ggml_build_forward_expand(&gf, x);
+        g4a_graph_add_op(gf, ops, [w, repacked, x, out] (int n_threads) {
+            mul_mat_blas(w, repacked, x, out, n_threads);
+        });
+        return out;
+    }
+#endif
+
+    if (!repacked) {
+        return ggml_mul_mat(ctx, w, x);
+    }
+#ifdef G4A_VNNI
+    assert(x->type == GGML_TYPE_F32 && x->ne[0] == w->ne[0] && x->ne[2] == 1 && x->ne[3] == 1);
+    assert(x->nb[1] == x->ne[0]*sizeof(float));
+
+    const int64_t nb = w->ne[0]/repack_blck;
+
+    struct ggml_tensor * x8  = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, N*nb*sizeof(block_x8));
+    struct ggml_tensor * out = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, w->ne[1], N);
+
+    ggml_build_forward_expand(&gf, x);
+    g4a_graph_add_op(gf, ops, [w, x, x8, out, N, nb] (int n_threads) {
+        block_x8 * xq = (block_x8 *) x8->data;
+
+        // quantize activations, then distribute the row groups
+        parallel_run(std::min(n_threads, N), [&] (int ith, int nth) {
+            for (int t = ith; t < N; t += nth) {
+                quantize_row_x8((const float *) x->data + t*x->ne[0], xq + t*nb, nb);
+            }
+        });
+        const int64_t n_groups = w->ne[1]/repack_rows;
+        parallel_run(std::min<int64_t>(n_threads, n_groups), [&] (int ith, int nth) {
+            mul_mat_vnni(w, xq, N, (float *) out->data, n_groups*ith/nth, n_groups*(ith + 1)/nth);
+        });
+    });
+    return out;
+#else
+    return ggml_mul_mat(ctx, w, x);
+#endif
+}
+
+struct ggml_tensor * g4a_mul_mat_rows(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * w, const std::vector<int> & rows, struct ggml_tensor * x, bool repacked, struct ggml_tensor * b) {
+    repacked = repacked && g4a_repack_supported(w);
+
+    assert(x->type == GGML_TYPE_F32 && x->ne[0] == w->ne[0] && x->ne[2] == 1 && x->ne[3] == 1);
+    assert(x->nb[1] == x->ne[0]*sizeof(float));
+    assert(!b || (b->type == GGML_TYPE_F32 && b->ne[0] == w->ne[1]));
+
+    const int N = x->ne[1];
+    const int n_rows = rows.size();
+
+    struct ggml_tensor * out = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_rows, N);
+
+    ggml_build_forward_expand(&gf, x);
+    g4a_graph_add_op(gf, ops, [w, rows, repacked, x, b, out, N, n_rows] (int n_threads) {
+        const int64_t n_per_row = w->ne[0];
+
+        // rows are dequantized one at a time and multiplied with every token
+        parallel_run(std::min(n_threads, n_rows), [&] (int ith, int nth) {
+            std::vector<float> row(n_per_row);
+            for (int i = ith; i < n_rows; i += nth) {
+                dequantize_rows(w, repacked, rows[i], rows[i] + 1, row.data());
+                const float bias = b ? ((const float *) b->data)[rows[i]] : 0.0f;
+                for (int t = 0; t < N; t++) {
+                    const float * xt = (const float *) x->data + t*n_per_row;
+                    float sum = bias;
+                    for (int64_t j = 0; j < n_per_row; j++) {
+                        sum += row[j]*xt[j];
+                    }
+                    ((float *) out->data)[t*n_rows + i] = sum;
+                }
+            }
+        });
+    });
+    return out;
+}
+
+
+bool g4a_logits_valid(const g4a_logits_spec & logits, int n_vocab) {
+    if (logits.tokens.size() > size_t(n_vocab)) {
+        fprintf(stderr, "%s: more logit tokens than the vocabulary has\n", __func__);
+        return false;
+    }
+    for (const auto token : logits.tokens) {
+        if (token < 0 || token >= n_vocab) {
+            fprintf(stderr, "%s: invalid token %d in logits\n", __func__, token);
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,269 @@
+// Graph operations and ggml helpers shared by the GPT-J and MPT implementations
+
+#pragma once
+
+#include <ggml.h>
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include <istream>
+#include <functional>
+
+//
+// File types
+//
+
+// Returns the weight type of given model wide file type (the f16 hparam); GGML_TYPE_COUNT if unsupported
+// Follows llama.cpp's ftype numbering; k-quants aren't available in this ggml
+ggml_type g4a_ftype_to_type(int32_t ftype);
+
+// Returns the file type to store in the f16 hparam for given weight type; -1 if there is none
+int32_t g4a_type_to_ftype(ggml_type type);
+
+// Returns true if a tensor of given type and row length can be loaded
+bool g4a_tensor_type_valid(int32_t type, int64_t row_length);
+
+struct g4a_tensor_info {
+    ggml_type type;
+    size_t    nbytes;
+    size_t    offset; // position of the data in the stream
+};
+
+// Reads the headers of all tensors from the current position of fin on and seeks back to it afterwards
+// Tensors may be stored in other types than the model wide one, e.g. if some were overridden during quantization
+bool g4a_read_tensor_infos(std::istream & fin, std::map<std::string, g4a_tensor_info> & infos);
+
+//
+// Memory mapped model files
+//
+
+// How weights are loaded from model files
+struct g4a_mmap_params {
+    bool use_mmap = false; // Point weights straight into the mapped file where their position allows instead of reading them
+    bool populate = false; // Fault the mapping in up front (MAP_POPULATE, or MADV_WILLNEED where unavailable) rather than on first use
+    bool mlock    = false; // Lock the weights into memory, mapped or read
+};
+
+// Returns true if tensor data of given type can be used in place at given offset of a mapped file
+// The offsets aren't padded in these model files, so whether they suit the alignment of the type is up to chance
+bool g4a_mmap_offset_valid(ggml_type type, size_t offset);
+
+// Read-only mapping of a whole file; its pages are shared with all other processes mapping the same file
+class g4a_mmap {
+    uint8_t * addr_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    g4a_mmap() = default;
+    g4a_mmap(const g4a_mmap&) = delete;
+    ~g4a_mmap();
+
+    // Maps fname, faulting it in up front if populate is set; returns false if the file or platform doesn't allow it
+    bool map(const std::string & fname, bool populate);
+
+    const uint8_t * addr() const {
+        return addr_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool contains(const void * p) const {
+        return p >= addr_ && p < addr_ + size_;
+    }
+};
+
+// Locks size bytes at addr into memory so they are never paged out; warns and returns false if that isn't permitted
+bool g4a_mlock(const void * addr, size_t size);
+
+
+//
+// Parallel loading
+//
+
+// Called with the share of the weights loaded so far in percent; returning false cancels loading
+using g4a_load_progress = std::function<bool (float progress)>;
+
+// Data of a tensor to read from a model file
+struct g4a_read_job {
+    size_t offset; // position in the file
+    size_t nbytes;
+    void * dst;
+};
+
+// Reads the data of all jobs from fname using up to n_threads threads with a stream of their own each
+// Large tensors are split into chunks so all threads stay busy till the end; progress is called from the calling thread
+// Returns false if the file couldn't be read or progress cancelled loading
+bool g4a_read_tensors(const std::string & fname, const std::vector<g4a_read_job> & jobs, int n_threads, const g4a_load_progress & progress);
+
+
+//
+// Type conversion
+//
+
+// Returns the number of bytes n consecutive values of given type take; n must be a multiple of its block size
+size_t g4a_row_size(ggml_type type, int64_t n);
+
+// Converts n consecutive values between F32, F16 and the quantized types
+void g4a_convert_row(ggml_type src_type, const void * src, ggml_type dst_type, void * dst, int64_t n);
+
+
+//
+// Partial graph computation
+//
+// Lets a graph be computed in node ranges, so work ggml can't express can run in between
+//
+
+// Work computed outside of ggml once all nodes before node are
+struct g4a_graph_op {
+    int node;
+    std::function<void (int n_threads)> compute;
+};
+using g4a_graph_ops = std::vector<g4a_graph_op>;
+
+// Position in a graph under construction, counted in both nodes and ops
+struct g4a_graph_pos {
+    int node;
+    size_t op;
+};
+
+// Adds op to be computed after everything expanded into gf so far
+void g4a_graph_add_op(const struct ggml_cgraph & gf, g4a_graph_ops & ops, std::function<void (int n_threads)> compute);
+
+// Returns the current end of gf and ops
+g4a_graph_pos g4a_graph_position(const struct ggml_cgraph & gf, const g4a_graph_ops & ops);
+
+// Upper bound of the work buffer size ggml_graph_compute needs for any node range of gf
+// Covers the ops used by the GPT-J and MPT graphs
+size_t g4a_graph_work_size(const struct ggml_cgraph & gf, int n_threads);
+
+// Returns a work buffer of at least given size for the calling thread, reused by its later graph computations
+// It lives outside of any ggml context, so compute buffers only have to hold the graph itself
+struct ggml_tensor * g4a_graph_work(size_t size);
+
+// Computes nodes [begin, end) of gf as a graph of its own using given preallocated work buffer
+// graph is scratch space for the partial graph; ggml_cgraph is too large for the stack to hold several of them
+void g4a_graph_compute_nodes(struct ggml_context * ctx, const struct ggml_cgraph & gf, struct ggml_cgraph & graph, int begin, int end, int n_threads, struct ggml_tensor * work);
+
+// Computes gf and ops from begin to end, each op right after the nodes it follows
+void g4a_graph_compute_range(struct ggml_context * ctx, const struct ggml_cgraph & gf, const g4a_graph_ops & ops, struct ggml_cgraph & graph, g4a_graph_pos begin, g4a_graph_pos end, int n_threads, struct ggml_tensor * work);
+
+// Computes all of gf and ops using the work buffer of the calling thread
+void g4a_graph_compute(struct ggml_context * ctx, struct ggml_cgraph & gf, const g4a_graph_ops & ops, int n_threads);
+
+// Copies x into dst like ggml_cpy, but dst may be of a quantized type too, which this ggml can't copy to
+// Returns the tensor to expand into gf; its data pointer is where the values are written when computed
+struct ggml_tensor * g4a_cpy(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * dst);
+
+
+//
+// Fused ops
+//
+// These are added to a graph as ops computing the rows of x in chunks, one per thread, reading the parameter vector
+// for every row, so neither the broadcasted parameters nor the intermediate results are ever materialized
+//
+
+// norm(x)*w, or norm(x)*w + b if b is given; b must directly follow w in memory
+struct ggml_tensor * g4a_norm_affine(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * w, struct ggml_tensor * b = nullptr);
+
+// x + b
+struct ggml_tensor * g4a_add_bias(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * b);
+
+// gelu(x + b)
+struct ggml_tensor * g4a_add_bias_gelu(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * x, struct ggml_tensor * b);
+
+// Builds the ops above from plain ggml ops on ggml_repeat'ed parameters instead if disabled, for benchmarking both
+// Graphs need more memory that way, so it must be set before loading the models that are evaluated
+void g4a_set_fused_ops(bool enabled);
+
+
+//
+// Reusable graphs
+//
+// A graph that only differs in n_past between evaluations can be built once for the largest n_past
+// and adjusted in place before each computation
+//
+
+// Sets the n_past parameter of a rope, diag_mask_inf or alibi node
+void g4a_set_n_past(struct ggml_tensor * node, int n_past);
+
+// Sets the extent of dimension dim of a tensor ggml allocated contiguously, recomputing the strides above it
+// Views keep their strides; set their extents directly
+void g4a_set_ne(struct ggml_tensor * t, int dim, int64_t ne);
+
+
+//
+// Compute buffers
+//
+// Graphs are built in buffers leased from a pool shared by all instances, so instances that don't evaluate
+// at the same time reuse the same memory
+//
+
+// Upper bound of the compute buffer size of a graph evaluating N tokens, where measure(n) builds the graph of n tokens in a
+// buffer large enough for it and returns the memory it used. Large batches are extrapolated from graphs of a few tokens,
+// so no buffer of the worst-case size has to be allocated to measure them
+size_t g4a_compute_buf_size(int N, const std::function<size_t (int n)> & measure);
+
+// Size of the object header this ggml precedes every tensor in a context with; a tensor's data follows the tensor
+constexpr size_t g4a_object_size = 32;
+
+// Upper bound of the memory a tensor without data of its own takes in a ggml context: the object header, the tensor
+// itself and room for the alignment of its data or small op parameters
+constexpr size_t g4a_tensor_overhead = g4a_object_size + sizeof(struct ggml_tensor) + 2*16;
+
+class g4a_compute_buffer {
+    uint8_t * addr_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    // Leases a pooled buffer of at least given size, allocating one if none fits
+    explicit g4a_compute_buffer(size_t size);
+    g4a_compute_buffer(const g4a_compute_buffer&) = delete;
+    // Returns the buffer to the pool
+    ~g4a_compute_buffer();
+
+    uint8_t * addr() const {
+        return addr_;
+    }
+    size_t size() const {
+        return size_;
+    }
+};
+
+
+//
+// Repacked weights
+//
+// Q4_0 and Q8_0 weights can be rearranged in place so the blocks of 16 rows are interleaved, which lets AVX-512 VNNI
+// compute 16 rows at once. ggml can't read them anymore afterwards, so their products are computed as graph ops instead
+//
+
+// Returns true if w can be repacked and the CPU can run the kernels for it
+bool g4a_repack_supported(const struct ggml_tensor * w);
+
+// Repacks w in place using up to n_threads threads
+void g4a_repack(struct ggml_tensor * w, int n_threads);
+
+// w*x like ggml_mul_mat, computed as an op of ops if repacked is set and w could be repacked
+// If ggml was built with BLAS, batches of 32 rows and more are computed by it too, dequantizing w in chunks first
+// x is expanded into gf first
+struct ggml_tensor * g4a_mul_mat(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * w, struct ggml_tensor * x, bool repacked);
+
+// w[rows]*x, or w[rows]*x + b[rows] if b is given: the products with only the given rows of w, in their order,
+// computed as an op of ops; costs about as much as reading those rows, so small subsets of large matrices are cheap
+struct ggml_tensor * g4a_mul_mat_rows(struct ggml_context * ctx, struct ggml_cgraph & gf, g4a_graph_ops & ops, struct ggml_tensor * w, const std::vector<int> & rows, struct ggml_tensor * x, bool repacked, struct ggml_tensor * b = nullptr);
+
+
+//
+// Logits
+//
+
+// Selects the logits an evaluation computes; the projection onto the vocabulary is the widest matmul of a model,
+// so leaving out tokens or positions that aren't needed saves most of its cost
+struct g4a_logits_spec {
+    bool all_tokens = false; // Logits for every evaluated token instead of just the last one, one row after another
+    std::vector<int> tokens; // Only the logits of these tokens, in this order; the whole vocabulary if empty
+};
+
+// Returns true if all tokens of logits are part of a vocabulary of n_vocab tokens; reports the first that isn't
+bool g4a_logits_valid(const g4a_logits_spec & logits, int n_vocab);
@@ -20,7 +20,7 @@ bool magic_match(std::istream& f) {
     return magic == 0x67676d6c;
 }
 
-LM::Inference *construct(const std::string &weights_path, std::ifstream& f, const LM::Inference::Params &p) {
-    return new LM::GPTJInference(weights_path, f, p);
+LM::Inference *construct(const std::string &weights_path, std::ifstream& f, const LM::Inference::Params &p, const LM::AppendCallback &on_progress) {
+    return new LM::GPTJInference(weights_path, f, p, on_progress);
 }
 }
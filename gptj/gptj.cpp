@@ -1,6 +1,8 @@
 #include "gptj.hpp"
 
 #include "../g4a_common.hpp"
+#include "../g4a_ops.hpp"
+#include "justlm_compute.hpp"
 
 #include <cassert>
 #include <cmath>
@@ -14,6 +16,9 @@
 #include "../msvc_compat_unistd.h"
 #include <sstream>
 #include <unordered_set>
+#include <thread>
+#include <memory>
+#include <algorithm>
 #include <ggml.h>
 
 constexpr inline
@@ -21,10 +26,12 @@ unsigned long long operator ""_MiB(unsigned long long bytes) {
     return bytes*1024*1024;
 }
 
+// allocates room for n_ctx tokens per layer
 static bool kv_cache_init(
         const struct gptj_hparams & hparams,
              struct gptj_kv_cache & cache,
-                         ggml_type   wtype,
+                         ggml_type   type_k,
+                         ggml_type   type_v,
                                int   n_ctx) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
@@ -32,7 +39,7 @@ static bool kv_cache_init(
     const int64_t n_mem      = (int64_t)n_layer*n_ctx;
     const int64_t n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2_MiB);
+    cache.buf.resize(g4a_row_size(type_k, n_elements) + g4a_row_size(type_v, n_elements) + 2_MiB);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -46,14 +53,71 @@ static bool kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, type_k, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, type_v, n_elements);
+
+    cache.n_ctx = n_ctx;
+
+    return true;
+}
+
+// reallocates a cache of model with room for n_ctx tokens per layer, keeping its contents
+static bool kv_cache_resize(gptj_model & model, gptj_kv_cache & cache, int n_ctx) {
+    // the current allocation is kept until its contents are copied
+    gptj_kv_cache old;
+    std::swap(old.ctx, cache.ctx);
+    std::swap(old.buf.addr, cache.buf.addr);
+    std::swap(old.buf.size, cache.buf.size);
+    old.k = cache.k;
+    old.v = cache.v;
+    old.n_ctx = cache.n_ctx;
+
+    if (!kv_cache_init(model.hparams, cache, old.k->type, old.v->type, n_ctx)) {
+        return false;
+    }
+
+    const int n_embd  = model.hparams.n_embd;
+    const int n_layer = model.hparams.n_layer;
+
+    const int n_cpy = std::min(old.n_ctx, n_ctx);
+
+    const size_t es_v = ggml_element_size(cache.v);
+
+    for (int il = 0; il < n_layer; il++) {
+        // keys are stored by position
+        memcpy((char *) cache.k->data + g4a_row_size(cache.k->type, size_t(il)*n_ctx*n_embd),
+               (char *) old.k->data   + g4a_row_size(cache.k->type, size_t(il)*old.n_ctx*n_embd), g4a_row_size(cache.k->type, size_t(n_cpy)*n_embd));
+
+        // values are stored transposed, one row of positions per element
+        for (int i = 0; i < n_embd; i++) {
+            memcpy((char *) cache.v->data + es_v*(size_t(il)*n_embd + i)*n_ctx,
+                   (char *) old.v->data   + es_v*(size_t(il)*n_embd + i)*old.n_ctx, es_v*n_cpy);
+        }
+    }
+
+    // the cached decode graph refers to the old allocation of the model's own cache
+    if (&cache == &model.kv_self) {
+        model.decode_graph.reset();
+    }
 
     return true;
 }
 
+// makes room for n_tokens tokens per layer if the cache is growable
+static bool kv_cache_reserve(gptj_model & model, gptj_kv_cache & cache, int n_tokens) {
+    if (n_tokens <= cache.n_ctx || cache.n_ctx >= cache.n_ctx_max) {
+        return true;
+    }
+
+    const int n_ctx = std::min((n_tokens + cache.n_chunk - 1)/cache.n_chunk*cache.n_chunk, cache.n_ctx_max);
+    return kv_cache_resize(model, cache, n_ctx);
+}
+
 // load the model's weights from a stream
-bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & model, gpt_vocab & vocab) {
+// the KV cache gets room for n_ctx tokens, or the context size of the model if 0; with n_ctx_chunk set it is allocated
+// in chunks of that many tokens as the context fills instead. Its values are stored as kv_type: F32, F16 or Q8_0
+// fin must read fname from its beginning; the weights are read from fname by several threads while progress is reported
+bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & model, gpt_vocab & vocab, int n_ctx, int n_ctx_chunk, ggml_type kv_type, const g4a_mmap_params & mmap_params, const g4a_load_progress & progress) {
     printf("%s: loading model from '%s' - please wait ...\n", __func__, fname.c_str());
 
     // verify magic
@@ -113,22 +177,49 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
 
     // for the big tensors, we have the option to store the data in 16-bit floats or quantized
     // in order to save memory and also to speed up the computation
-    ggml_type wtype = GGML_TYPE_COUNT;
-    switch (model.hparams.f16) {
-        case 0: wtype = GGML_TYPE_F32;  break;
-        case 1: wtype = GGML_TYPE_F16;  break;
-        case 2: wtype = GGML_TYPE_Q4_0; break;
-        case 3: wtype = GGML_TYPE_Q4_1; break;
-        default:
-                {
-                    fprintf(stderr, "%s: invalid model file '%s' (bad f16 value %d)\n",
-                            __func__, fname.c_str(), model.hparams.f16);
-                    return false;
-                }
+    const ggml_type wtype = g4a_ftype_to_type(model.hparams.f16);
+    if (wtype == GGML_TYPE_COUNT) {
+        fprintf(stderr, "%s: invalid model file '%s' (bad f16 value %d)\n",
+                __func__, fname.c_str(), model.hparams.f16);
+        return false;
     }
 
     const ggml_type wtype2 = GGML_TYPE_F32;
 
+    // weights may be stored in other types than the model wide one
+    std::map<std::string, g4a_tensor_info> tensor_infos;
+    if (!g4a_read_tensor_infos(fin, tensor_infos)) {
+        fprintf(stderr, "%s: invalid model file '%s' (bad tensor header)\n", __func__, fname.c_str());
+        return false;
+    }
+    const auto tensor_type = [&] (const std::string & name) {
+        const auto res = tensor_infos.find(name);
+        return res == tensor_infos.end() ? wtype : res->second.type;
+    };
+
+    // weights used as they are stored can point straight into the mapped file if their offset suits their type
+    // q, k and v are packed into one matrix on load and norm weights with their biases, so they are always read
+    if (mmap_params.use_mmap) {
+        model.mapping = std::make_unique<g4a_mmap>();
+        if (!model.mapping->map(fname, mmap_params.populate)) {
+            fprintf(stderr, "%s: failed to map '%s', reading it instead\n", __func__, fname.c_str());
+            model.mapping.reset();
+        }
+    }
+    std::unordered_set<std::string> direct_weights = {"transformer.wte.weight", "lm_head.weight"};
+    for (int i = 0; i < model.hparams.n_layer; ++i) {
+        const std::string prefix = "transformer.h." + std::to_string(i) + ".";
+        direct_weights.insert({prefix + "attn.out_proj.weight", prefix + "mlp.fc_in.weight", prefix + "mlp.fc_out.weight"});
+    }
+    const auto mapped_info = [&] (const std::string & name) -> const g4a_tensor_info * {
+        const auto res = tensor_infos.find(name);
+        if (!model.mapping || res == tensor_infos.end() || !direct_weights.count(name) ||
+            !g4a_mmap_offset_valid(res->second.type, res->second.offset) || res->second.offset + res->second.nbytes > model.mapping->size()) {
+            return nullptr;
+        }
+        return &res->second;
+    };
+
     auto & ctx = model.ctx;
 
     size_t ctx_size = 0;
@@ -138,7 +229,6 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
 
         const int n_embd  = hparams.n_embd;
         const int n_layer = hparams.n_layer;
-        const int n_ctx   = hparams.n_ctx;
         const int n_vocab = hparams.n_vocab;
 
         ctx_size += n_embd*ggml_type_sizef(GGML_TYPE_F32); // ln_f_g
@@ -152,9 +242,7 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
         ctx_size += n_layer*(n_embd*ggml_type_sizef(GGML_TYPE_F32)); // ln_1_g
         ctx_size += n_layer*(n_embd*ggml_type_sizef(GGML_TYPE_F32)); // ln_1_b
 
-        ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_q_proj_w
-        ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_k_proj_w
-        ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_v_proj_w
+        ctx_size += n_layer*(3*n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_qkv_w
 
         ctx_size += n_layer*(n_embd*n_embd*ggml_type_sizef(wtype)); // c_attn_proj_w
 
@@ -164,19 +252,32 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
         ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_sizef(wtype));         // c_mlp_proj_w
         ctx_size += n_layer*(         n_embd*ggml_type_sizef(GGML_TYPE_F32)); // c_mlp_proj_b
 
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F32); // memory_k
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F32); // memory_v
+        ctx_size += (6 + 15*n_layer)*256; // object overhead
+
+        // weights stored at a higher precision than the model wide type need more
+        size_t file_size = (6 + 15*n_layer)*256;
+        for (const auto & info : tensor_infos) {
+            file_size += info.second.nbytes;
+        }
+        ctx_size = std::max(ctx_size, file_size);
 
-        ctx_size += (5 + 10*n_layer)*256; // object overhead
+        // mapped weights take no memory of their own
+        for (const auto & info : tensor_infos) {
+            if (mapped_info(info.first)) {
+                ctx_size -= info.second.nbytes;
+            }
+        }
 
         printf("%s: ggml ctx size = %6.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
 
     // create the ggml context
     {
+        model.weights_buf.resize(ctx_size);
+
         struct ggml_init_params params = {
-            .mem_size   = ctx_size,
-            .mem_buffer = NULL,
+            .mem_size   = model.weights_buf.size,
+            .mem_buffer = model.weights_buf.addr,
         };
 
         model.ctx = ggml_init(params);
@@ -186,6 +287,31 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
         }
     }
 
+    // and the one of the mapped weights, which only holds their headers
+    if (model.mapping) {
+        struct ggml_init_params params = {
+            .mem_size   = size_t(6 + 15*model.hparams.n_layer)*256,
+            .mem_buffer = NULL,
+            .no_alloc   = true,
+        };
+
+        model.ctx_mapped = ggml_init(params);
+        if (!model.ctx_mapped) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            return false;
+        }
+    }
+
+    // creates a weight of given name, pointing into the mapped file if possible
+    const auto new_weight = [&] (const std::string & name, int64_t ne0, int64_t ne1) {
+        if (const auto info = mapped_info(name)) {
+            struct ggml_tensor * tensor = ggml_new_tensor_2d(model.ctx_mapped, info->type, ne0, ne1);
+            tensor->data = (void *) (model.mapping->addr() + info->offset);
+            return tensor;
+        }
+        return ggml_new_tensor_2d(ctx, tensor_type(name), ne0, ne1);
+    };
+
     // prepare memory for the weights
     {
         const auto & hparams = model.hparams;
@@ -196,12 +322,14 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
 
         model.layers.resize(n_layer);
 
-        model.wte    = ggml_new_tensor_2d(ctx, wtype,         n_embd, n_vocab);
+        model.wte    = new_weight("transformer.wte.weight", n_embd, n_vocab);
 
-        model.ln_f_g = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
-        model.ln_f_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+        // norm weights and biases are packed together for g4a_norm_affine
+        struct ggml_tensor * ln_f_gb = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 2*n_embd);
+        model.ln_f_g = ggml_view_1d(ctx, ln_f_gb, n_embd, 0);
+        model.ln_f_b = ggml_view_1d(ctx, ln_f_gb, n_embd, n_embd*ggml_element_size(ln_f_gb));
 
-        model.lmh_g  = ggml_new_tensor_2d(ctx, wtype,         n_embd, n_vocab);
+        model.lmh_g  = new_weight("lm_head.weight", n_embd, n_vocab);
         model.lmh_b  = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_vocab);
 
         // map by name
@@ -216,36 +344,43 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
         for (int i = 0; i < n_layer; ++i) {
             auto & layer = model.layers[i];
 
-            layer.ln_1_g          = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
-            layer.ln_1_b          = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
+            const std::string prefix = "transformer.h." + std::to_string(i) + ".";
+
+            struct ggml_tensor * ln_1_gb = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 2*n_embd);
+            layer.ln_1_g          = ggml_view_1d(ctx, ln_1_gb, n_embd, 0);
+            layer.ln_1_b          = ggml_view_1d(ctx, ln_1_gb, n_embd, n_embd*ggml_element_size(ln_1_gb));
+
+            // q, k and v must share the type of q
+            layer.c_attn_qkv_w    = ggml_new_tensor_2d(ctx, tensor_type(prefix + "attn.q_proj.weight"), n_embd, 3*n_embd);
 
-            layer.c_attn_q_proj_w = ggml_new_tensor_2d(ctx, wtype,           n_embd,   n_embd);
-            layer.c_attn_k_proj_w = ggml_new_tensor_2d(ctx, wtype,           n_embd,   n_embd);
-            layer.c_attn_v_proj_w = ggml_new_tensor_2d(ctx, wtype,           n_embd,   n_embd);
+            // the model file stores q, k and v separately; load them straight into their rows of c_attn_qkv_w
+            layer.c_attn_q_proj_w = ggml_view_2d(ctx, layer.c_attn_qkv_w, n_embd, n_embd, layer.c_attn_qkv_w->nb[1], 0*n_embd*layer.c_attn_qkv_w->nb[1]);
+            layer.c_attn_k_proj_w = ggml_view_2d(ctx, layer.c_attn_qkv_w, n_embd, n_embd, layer.c_attn_qkv_w->nb[1], 1*n_embd*layer.c_attn_qkv_w->nb[1]);
+            layer.c_attn_v_proj_w = ggml_view_2d(ctx, layer.c_attn_qkv_w, n_embd, n_embd, layer.c_attn_qkv_w->nb[1], 2*n_embd*layer.c_attn_qkv_w->nb[1]);
 
-            layer.c_attn_proj_w   = ggml_new_tensor_2d(ctx, wtype,           n_embd,   n_embd);
+            layer.c_attn_proj_w   = new_weight(prefix + "attn.out_proj.weight", n_embd, n_embd);
 
-            layer.c_mlp_fc_w      = ggml_new_tensor_2d(ctx, wtype,           n_embd, 4*n_embd);
+            layer.c_mlp_fc_w      = new_weight(prefix + "mlp.fc_in.weight",    n_embd, 4*n_embd);
             layer.c_mlp_fc_b      = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_embd);
 
-            layer.c_mlp_proj_w    = ggml_new_tensor_2d(ctx, wtype,         4*n_embd,   n_embd);
+            layer.c_mlp_proj_w    = new_weight(prefix + "mlp.fc_out.weight", 4*n_embd, n_embd);
             layer.c_mlp_proj_b    = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_embd);
 
             // map by name
-            model.tensors["transformer.h." + std::to_string(i) + ".ln_1.weight"]          = layer.ln_1_g;
-            model.tensors["transformer.h." + std::to_string(i) + ".ln_1.bias"]            = layer.ln_1_b;
+            model.tensors[prefix + "ln_1.weight"]          = layer.ln_1_g;
+            model.tensors[prefix + "ln_1.bias"]            = layer.ln_1_b;
 
-            model.tensors["transformer.h." + std::to_string(i) + ".attn.q_proj.weight"]   = layer.c_attn_q_proj_w;
-            model.tensors["transformer.h." + std::to_string(i) + ".attn.k_proj.weight"]   = layer.c_attn_k_proj_w;
-            model.tensors["transformer.h." + std::to_string(i) + ".attn.v_proj.weight"]   = layer.c_attn_v_proj_w;
+            model.tensors[prefix + "attn.q_proj.weight"]   = layer.c_attn_q_proj_w;
+            model.tensors[prefix + "attn.k_proj.weight"]   = layer.c_attn_k_proj_w;
+            model.tensors[prefix + "attn.v_proj.weight"]   = layer.c_attn_v_proj_w;
 
-            model.tensors["transformer.h." + std::to_string(i) + ".attn.out_proj.weight"] = layer.c_attn_proj_w;
+            model.tensors[prefix + "attn.out_proj.weight"] = layer.c_attn_proj_w;
 
-            model.tensors["transformer.h." + std::to_string(i) + ".mlp.fc_in.weight"]     = layer.c_mlp_fc_w;
-            model.tensors["transformer.h." + std::to_string(i) + ".mlp.fc_in.bias"]       = layer.c_mlp_fc_b;
+            model.tensors[prefix + "mlp.fc_in.weight"]     = layer.c_mlp_fc_w;
+            model.tensors[prefix + "mlp.fc_in.bias"]       = layer.c_mlp_fc_b;
 
-            model.tensors["transformer.h." + std::to_string(i) + ".mlp.fc_out.weight"]    = layer.c_mlp_proj_w;
-            model.tensors["transformer.h." + std::to_string(i) + ".mlp.fc_out.bias"]      = layer.c_mlp_proj_b;
+            model.tensors[prefix + "mlp.fc_out.weight"]    = layer.c_mlp_proj_w;
+            model.tensors[prefix + "mlp.fc_out.bias"]      = layer.c_mlp_proj_b;
         }
     }
 
@@ -253,7 +388,22 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
     {
         const auto & hparams = model.hparams;
 
-        if (!kv_cache_init(hparams, model.kv_self, GGML_TYPE_F32, model.hparams.n_ctx)) {
+        auto & kv_self = model.kv_self;
+        kv_self.n_ctx_max = n_ctx > 0 ? n_ctx : hparams.n_ctx;
+        kv_self.n_chunk   = std::max(0, n_ctx_chunk);
+
+        // quantized keys need whole blocks per head; values are stored transposed, so quantization
+        // blocks would span positions written at different times, and they are kept at F16 instead
+        ggml_type type_k = kv_type;
+        ggml_type type_v = kv_type;
+        if (ggml_blck_size(kv_type) > 1) {
+            if ((hparams.n_embd/hparams.n_head) % ggml_blck_size(kv_type) != 0) {
+                type_k = GGML_TYPE_F16;
+            }
+            type_v = GGML_TYPE_F16;
+        }
+
+        if (!kv_cache_init(hparams, kv_self, type_k, type_v, kv_self.n_chunk ? std::min(kv_self.n_chunk, kv_self.n_ctx_max) : kv_self.n_ctx_max)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             ggml_free(ctx);
             return false;
@@ -264,11 +414,12 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
     }
 
     // load weights
+    // the headers are checked first, then the data of all tensors that aren't mapped is read in parallel
+    size_t mapped_size = 0;
     {
         int n_tensors = 0;
         size_t total_size = 0;
-
-        printf("%s: ", __func__);
+        std::vector<g4a_read_job> jobs;
 
         while (true) {
             int32_t n_dims;
@@ -310,24 +461,17 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
                 return false;
             }
 
+            // for debugging
             if (0) {
-                static const char * ftype_str[] = { "f32", "f16", "q4_0", "q4_1", };
-                printf("%24s - [%5d, %5d], type = %6s, %6.2f MB, %9zu bytes\n", name.data(), ne[0], ne[1], ftype_str[ftype], ggml_nbytes(tensor)/1024.0/1024.0, ggml_nbytes(tensor));
+                printf("%24s - [%5d, %5d], type = %6s, %6.2f MB, %9zu bytes\n", name.data(), ne[0], ne[1], ggml_type_name(ggml_type(ftype)), ggml_nbytes(tensor)/1024.0/1024.0, ggml_nbytes(tensor));
             }
 
-            size_t bpe = 0;
+            if (!g4a_tensor_type_valid(ftype, ne[0]) || ggml_type(ftype) != tensor->type) {
+                fprintf(stderr, "%s: tensor '%s' has unsupported or unexpected type %d in model file\n", __func__, name.data(), ftype);
+                return false;
+            }
 
-            switch (ftype) {
-                case 0: bpe = ggml_type_size(GGML_TYPE_F32);  break;
-                case 1: bpe = ggml_type_size(GGML_TYPE_F16);  break;
-                case 2: bpe = ggml_type_size(GGML_TYPE_Q4_0); assert(ne[0] % 64 == 0); break;
-                case 3: bpe = ggml_type_size(GGML_TYPE_Q4_1); assert(ne[0] % 64 == 0); break;
-                default:
-                        {
-                            fprintf(stderr, "%s: unknown ftype %d in model file\n", __func__, ftype);
-                            return false;
-                        }
-            };
+            const size_t bpe = ggml_type_size(ggml_type(ftype));
 
             if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
                 fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
@@ -335,91 +479,235 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            if (model.mapping && model.mapping->contains(tensor->data)) {
+                fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+                mapped_size += ggml_nbytes(tensor);
+            } else {
+                jobs.push_back({size_t(fin.tellg()), ggml_nbytes(tensor), tensor->data});
+                fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+            }
 
             //printf("%42s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
-            if (++n_tensors % 8 == 0) {
-                printf(".");
-                fflush(stdout);
-            }
+            n_tensors++;
         }
 
-        printf(" done\n");
+        // more streams than that don't add throughput on common storage
+        const int n_threads = std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+        if (!g4a_read_tensors(fname, jobs, n_threads, progress)) {
+            return false;
+        }
 
         printf("%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
+        if (model.mapping) {
+            printf("%s: mapped size = %8.2f MB\n", __func__, mapped_size/1024.0/1024.0);
+        }
+    }
+
+    // the mapping isn't needed if the offsets of all weights were unsuitable
+    if (model.mapping && !mapped_size) {
+        model.mapping.reset();
+    }
+
+    if (mmap_params.mlock) {
+        g4a_mlock(model.weights_buf.addr, model.weights_buf.size);
+        if (model.mapping) {
+            g4a_mlock(model.mapping->addr(), model.mapping->size());
+        }
+    }
+
+    // interleave the rows of quantized weights for the AVX-512 VNNI kernels where supported
+    // mapped weights are read-only and shared, so they are kept as stored along with all others
+    // progress is reported again before each, so loading can still be cancelled meanwhile
+    if (!model.mapping) {
+        const int n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        int n_repacked = 0;
+        std::vector<ggml_tensor *> weights = {model.lmh_g};
+        for (const auto & layer : model.layers) {
+            weights.insert(weights.end(), {layer.c_attn_qkv_w, layer.c_attn_proj_w, layer.c_mlp_fc_w, layer.c_mlp_proj_w});
+        }
+        for (auto w : weights) {
+            if (g4a_repack_supported(w)) {
+                if (progress && !progress(100.f)) {
+                    return false;
+                }
+                g4a_repack(w, n_threads);
+                n_repacked++;
+            }
+        }
+        model.repacked = true;
+
+        if (n_repacked) {
+            printf("%s: repacked %d tensors\n", __func__, n_repacked);
+        }
     }
 
     return true;
 }
 
 // load the model's weights from a file path
-bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab) {
+bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab, int n_ctx, int n_ctx_chunk, ggml_type kv_type, const g4a_mmap_params & mmap_params, const g4a_load_progress & progress) {
     auto fin = std::ifstream(fname, std::ios::binary);
     if (!fin) {
         fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
         return false;
     }
 
-    bool loaded = gptj_model_load(fname, fin, model, vocab);
+    bool loaded = gptj_model_load(fname, fin, model, vocab, n_ctx, n_ctx_chunk, kv_type, mmap_params, progress);
     fin.close();
     return loaded;
 }
 
-// evaluate the transformer
-//
-//   - model:     the model
-//   - n_threads: number of threads to use
-//   - n_past:    the context size so far
-//   - embd_inp:  the embeddings of the tokens in the context
-//   - embd_w:    the predicted logits for the next token
-//
-// The GPT-J model requires about 16MB of memory per input token.
-//
-bool gptj_eval(
-        gptj_model & model,
-        const int n_threads,
+// builds the attention of the N tokens in Qcur, Kcur and Vcur after n_past tokens in kv, storing their keys and values
+// there; returns the copy of its result into dst, which is [n_embd, N] like the inputs
+static struct ggml_tensor * gptj_build_attention(
+        const gptj_model & model,
+        gptj_graph & graph,
+        const gptj_kv_cache & kv,
+        const int il,
         const int n_past,
+        struct ggml_tensor * Qcur,
+        struct ggml_tensor * Kcur,
+        struct ggml_tensor * Vcur,
+        struct ggml_tensor * dst) {
+    const int N = Qcur->ne[1];
+
+    const auto & hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+    const int n_ctx  = kv.n_ctx; // per layer stride of the KV cache
+    const int n_head = hparams.n_head;
+    const int n_rot  = hparams.n_rot;
+
+    struct ggml_context * ctx0 = graph.ctx;
+
+    auto & gf  = graph.gf;
+    auto & ops = graph.ops;
+
+    // Q = rope(Qcur).view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+    struct ggml_tensor * Qrot = ggml_rope(ctx0,
+                ggml_reshape_3d(ctx0, Qcur, n_embd/n_head, n_head, N),
+                n_past, n_rot, 0);
+    struct ggml_tensor * Q = ggml_permute(ctx0, Qrot, 0, 2, 1, 3);
+
+    // store key and value to memory
+    // keys are stored rotated at their absolute position and values transposed,
+    // so previous tokens never have to be touched again
+    struct ggml_tensor * Krot;
+    struct ggml_tensor * k, * k_cpy;
+    struct ggml_tensor * v, * v_cpy;
+    {
+        Krot = ggml_rope(ctx0,
+                ggml_reshape_3d(ctx0, Kcur, n_embd/n_head, n_head, N),
+                n_past, n_rot, 0);
+
+        k = ggml_view_1d(ctx0, kv.k, N*n_embd, g4a_row_size(kv.k->type, n_embd*(size_t(il)*n_ctx + n_past)));
+        v = ggml_view_2d(ctx0, kv.v, N, n_embd,
+                (   n_ctx)*ggml_element_size(kv.v),
+                (il*n_ctx)*ggml_element_size(kv.v)*n_embd + n_past*ggml_element_size(kv.v));
+
+        // keys may be quantized
+        k_cpy = g4a_cpy(ctx0, gf, ops, Krot, k);
+        v_cpy = ggml_cpy(ctx0, ggml_transpose(ctx0, Vcur), v);
+
+        ggml_build_forward_expand(&gf, k_cpy);
+        ggml_build_forward_expand(&gf, v_cpy);
+    }
+
+    // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
+    struct ggml_tensor * Kmem = ggml_view_1d(ctx0, kv.k, (n_past + N)*n_embd, g4a_row_size(kv.k->type, size_t(il)*n_ctx*n_embd));
+    struct ggml_tensor * Kmem_3d = ggml_reshape_3d(ctx0, Kmem, n_embd/n_head, n_head, n_past + N);
+    struct ggml_tensor * K = ggml_permute(ctx0, Kmem_3d, 0, 2, 1, 3);
+
+    // K * Q
+    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+    // KQ_scaled = KQ / sqrt(n_embd/n_head)
+    struct ggml_tensor * KQ_scaled =
+        ggml_scale(ctx0,
+                KQ,
+                ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
+                );
+
+    // KQ_masked = mask_past(KQ_scaled)
+    struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+
+    // KQ = soft_max(KQ_masked)
+    struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+    // V_trans = Vmem.view(n_past + N, n_embd/n_head, n_head), already stored transposed
+    struct ggml_tensor * V_trans =
+        ggml_view_3d(ctx0, kv.v,
+                n_past + N, n_embd/n_head, n_head,
+                n_ctx*ggml_element_size(kv.v),
+                n_ctx*ggml_element_size(kv.v)*n_embd/n_head,
+                il*n_ctx*ggml_element_size(kv.v)*n_embd);
+
+    // KQV = transpose(V) * KQ_soft_max
+    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+
+    // everything above that depends on n_past, for reusing the graph
+    if (graph.reusable) {
+        graph.n_past_updates.push_back([&model, &kv, il, N, Qrot, Krot, k, k_cpy, v, v_cpy, Kmem, Kmem_3d, K, KQ, KQ_scaled, KQ_masked, KQ_soft_max, V_trans] (int n_past) {
+            const int n_ctx  = kv.n_ctx;
+            const int n_embd = model.hparams.n_embd;
+
+            g4a_set_n_past(Qrot, n_past);
+            g4a_set_n_past(Krot, n_past);
+
+            // new keys and values are stored at n_past
+            const size_t v_size = ggml_element_size(kv.v);
+            k_cpy->data = k->data = (char *) kv.k->data + g4a_row_size(kv.k->type, n_embd*(size_t(il)*n_ctx + n_past));
+            v_cpy->data = v->data = (char *) kv.v->data + (il*n_ctx)*v_size*n_embd + n_past*v_size;
+
+            // attention spans the first n_past + N cached tokens
+            const int n_kv = n_past + N;
+            g4a_set_ne(Kmem, 0, n_kv*n_embd);
+            g4a_set_ne(Kmem_3d, 2, n_kv);
+            K->ne[1] = n_kv;
+            for (auto scores : {KQ, KQ_scaled, KQ_masked, KQ_soft_max}) {
+                g4a_set_ne(scores, 0, n_kv);
+            }
+            g4a_set_n_past(KQ_masked, n_past);
+            V_trans->ne[0] = n_kv;
+        });
+    }
+
+    // KQV_merged = KQV.permute(0, 2, 1, 3)
+    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+    // dst = KQV_merged.contiguous().view(n_embd, N)
+    return ggml_cpy(ctx0, KQV_merged, dst);
+}
+
+// builds the graph evaluating embd_inp in graph.ctx; its tokens belong to seqs one after another
+static void gptj_build_graph(
+        const gptj_model & model,
+        gptj_graph & graph,
+        const std::vector<gptj_graph_seq> & seqs,
         const std::vector<gpt_vocab::id> & embd_inp,
-              std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
+        const g4a_logits_spec & logits = {}) {
     const int N = embd_inp.size();
 
     const auto & hparams = model.hparams;
 
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
-    const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
-    const int n_rot   = hparams.n_rot;
-
-    static size_t buf_size = 1024_MiB;
-    if (!model.buf.addr || model.buf.size < buf_size)
-        model.buf.resize(buf_size);
-
-    if (mem_per_token > 0 && mem_per_token*N > model.buf.size) {
-        const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, model.buf.size, buf_size_new);
 
-        // reallocate
-        model.buf.resize(buf_size_new);
-        if (model.buf.addr == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.buf.size);
-            return false;
-        }
-    }
+    struct ggml_context * ctx0 = graph.ctx;
 
-    struct ggml_init_params params = {
-        .mem_size   = model.buf.size,
-        .mem_buffer = model.buf.addr,
-    };
+    auto & gf         = graph.gf;
+    auto & ops        = graph.ops;
+    auto & attn_range = graph.attn_range;
+    auto & ffn_range  = graph.ffn_range;
 
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf = { .n_threads = n_threads };
+    attn_range.resize(n_layer);
+    ffn_range.resize(n_layer);
 
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+    graph.embd = embd;
 
     // wte
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, embd);
@@ -429,124 +717,77 @@ bool gptj_eval(
 
         // norm
         {
-            cur = ggml_norm(ctx0, inpL);
-
-            // cur = ln_1_g*cur + ln_1_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.layers[il].ln_1_g, cur),
-                        cur),
-                    ggml_repeat(ctx0, model.layers[il].ln_1_b, cur));
+            // cur = ln_1_g*norm(inpL) + ln_1_b
+            cur = g4a_norm_affine(ctx0, gf, ops, inpL, model.layers[il].ln_1_g, model.layers[il].ln_1_b);
         }
 
         struct ggml_tensor * inpSA = cur;
 
+        ggml_build_forward_expand(&gf, inpSA);
+        attn_range[il].first = g4a_graph_position(gf, ops);
+
         // self-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0, model.layers[il].c_attn_q_proj_w, cur);
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0, model.layers[il].c_attn_k_proj_w, cur);
-            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].c_attn_v_proj_w, cur);
-
-            // store key and value to memory
-            if (N >= 1) {
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctx0, model.kv_self.v, N*n_embd, (ggml_element_size(model.kv_self.v)*n_embd)*(il*n_ctx + n_past));
-
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+            // compute QKV in one go
+            cur = g4a_mul_mat(ctx0, gf, ops, model.layers[il].c_attn_qkv_w, cur, model.repacked);
+
+            struct ggml_tensor * Qcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 0*ggml_element_size(cur)*n_embd));
+            struct ggml_tensor * Kcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 1*ggml_element_size(cur)*n_embd));
+            struct ggml_tensor * Vcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 2*ggml_element_size(cur)*n_embd));
+
+            // each sequence attends to its own cache only
+            if (seqs.size() == 1) {
+                cur = gptj_build_attention(model, graph, *seqs[0].kv, il, seqs[0].n_past, Qcur, Kcur, Vcur,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+            } else {
+                cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+
+                int row = 0;
+                for (const auto & seq : seqs) {
+                    // rows of the tokens of the sequence
+                    const auto rows = [&] (struct ggml_tensor * t) {
+                        return ggml_view_2d(ctx0, t, n_embd, seq.N, t->nb[1], row*t->nb[1]);
+                    };
+                    ggml_build_forward_expand(&gf, gptj_build_attention(model, graph, *seq.kv, il, seq.n_past, rows(Qcur), rows(Kcur), rows(Vcur), rows(cur)));
+                    row += seq.N;
+                }
             }
 
-            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_rope(ctx0,
-                            ggml_cpy(ctx0,
-                                Qcur,
-                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
-                            n_past, n_rot, 0),
-                        0, 2, 1, 3);
-
-            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_rope(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.k)*n_embd),
-                                n_embd/n_head, n_head, n_past + N),
-                            n_past, n_rot, 1),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0,
-                        KQ,
-                        ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
-                        );
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
-            struct ggml_tensor * V_trans =
-                ggml_cpy(ctx0,
-                        ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, model.kv_self.v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.v)*n_embd),
-                                n_embd/n_head, n_head, n_past + N),
-                            1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, model.kv_self.v->type, n_past + N, n_embd/n_head, n_head));
-
-            // KQV = transpose(V) * KQ_soft_max
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
-
             // projection (no bias)
-            cur = ggml_mul_mat(ctx0,
+            cur = g4a_mul_mat(ctx0, gf, ops,
                     model.layers[il].c_attn_proj_w,
-                    cur);
+                    cur, model.repacked);
         }
 
         struct ggml_tensor * inpFF = cur;
 
+        ggml_build_forward_expand(&gf, inpFF);
+        attn_range[il].second = ffn_range[il].first = g4a_graph_position(gf, ops);
+
         // feed-forward network
-        // this is independent of the self-attention result, so it could be done in parallel to the self-attention
+        // this is independent of the self-attention result, so it can be done in parallel to the self-attention
         {
             // note here we pass inpSA instead of cur
-            cur = ggml_mul_mat(ctx0,
+            cur = g4a_mul_mat(ctx0, gf, ops,
                     model.layers[il].c_mlp_fc_w,
-                    inpSA);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].c_mlp_fc_b, cur),
-                    cur);
+                    inpSA, model.repacked);
 
             // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+            // cur = gelu(cur + fc_b)
+            cur = g4a_add_bias_gelu(ctx0, gf, ops, cur, model.layers[il].c_mlp_fc_b);
 
             // projection
             // cur = proj_w*cur + proj_b
-            cur = ggml_mul_mat(ctx0,
+            cur = g4a_mul_mat(ctx0, gf, ops,
                     model.layers[il].c_mlp_proj_w,
-                    cur);
+                    cur, model.repacked);
 
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].c_mlp_proj_b, cur),
-                    cur);
+            cur = g4a_add_bias(ctx0, gf, ops, cur, model.layers[il].c_mlp_proj_b);
         }
 
+        ggml_build_forward_expand(&gf, cur);
+        ffn_range[il].second = g4a_graph_position(gf, ops);
+
         // self-attention + FF
         cur  = ggml_add(ctx0, cur, inpFF);
 
@@ -554,68 +795,454 @@ bool gptj_eval(
         inpL = ggml_add(ctx0, cur, inpL);
     }
 
+    // only the last token of each sequence is projected onto the vocabulary unless the logits of all are requested
+    if (!logits.all_tokens && seqs.size() == 1 && N > 1) {
+        inpL = ggml_view_2d(ctx0, inpL, n_embd, 1, inpL->nb[1], (N - 1)*inpL->nb[1]);
+    } else if (!logits.all_tokens && seqs.size() > 1) {
+        struct ggml_tensor * last = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, seqs.size());
+        int row = 0;
+        for (size_t i = 0; i < seqs.size(); i++) {
+            row += seqs[i].N;
+            ((int32_t *) last->data)[i] = row - 1;
+        }
+        inpL = ggml_get_rows(ctx0, inpL, last);
+    }
+
     // norm
     {
-        inpL = ggml_norm(ctx0, inpL);
-
-        // inpL = ln_f_g*inpL + ln_f_b
-        inpL = ggml_add(ctx0,
-                ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.ln_f_g, inpL),
-                    inpL),
-                ggml_repeat(ctx0, model.ln_f_b, inpL));
+        // inpL = ln_f_g*norm(inpL) + ln_f_b
+        inpL = g4a_norm_affine(ctx0, gf, ops, inpL, model.ln_f_g, model.ln_f_b);
     }
 
     // lm_head
-    {
-        inpL = ggml_mul_mat(ctx0, model.lmh_g, inpL);
+    if (logits.tokens.empty()) {
+        inpL = g4a_mul_mat(ctx0, gf, ops, model.lmh_g, inpL, model.repacked);
 
-        inpL = ggml_add(ctx0,
-                ggml_repeat(ctx0, model.lmh_b, inpL),
-                inpL);
+        inpL = g4a_add_bias(ctx0, gf, ops, inpL, model.lmh_b);
+    } else {
+        // just the rows of the requested tokens
+        inpL = g4a_mul_mat_rows(ctx0, gf, ops, model.lmh_g, logits.tokens, inpL, model.repacked, model.lmh_b);
     }
 
-    // logits -> probs
-    //inpL = ggml_soft_max(ctx0, inpL);
+    ggml_build_forward_expand(&gf, inpL);
+    graph.logits = inpL;
+
+}
+
+// builds the graph evaluating embd_inp after n_past tokens in the cache of the model in graph.ctx
+static void gptj_build_graph(
+        const gptj_model & model,
+        gptj_graph & graph,
+        const int n_past,
+        const std::vector<gpt_vocab::id> & embd_inp,
+        const g4a_logits_spec & logits = {}) {
+    gptj_build_graph(model, graph, {{&model.kv_self, n_past, int(embd_inp.size())}}, embd_inp, logits);
+}
+
+// returns the size of the compute buffer evaluating N tokens needs at most, computing the logits of all of them
+// if all_logits is set; logits of a subset of the vocabulary need less
+// measured once per batch size by building the graph for the end of the context, where it is largest,
+// in a generously sized temporary buffer; tensor data isn't written while building, so its pages are never touched
+size_t gptj_eval_buf_size(gptj_model & model, const int N, bool all_logits) {
+    auto & buf_size = model.eval_buf_sizes[{N, all_logits}];
+    if (buf_size) {
+        return buf_size;
+    }
+
+    const auto & hparams = model.hparams;
+
+    // the largest context the KV cache may grow to; the attention scores of a graph built for its end are
+    // as large as they get, and grow linearly with N like everything else
+    const int n_ctx = model.kv_self.n_ctx_max;
+
+    buf_size = g4a_compute_buf_size(N, [&] (int n) {
+        // at most 32 activations of n_embd, and 4 of the attention scores, per token and layer
+        const size_t bound = 16_MiB + size_t(n)*(size_t(hparams.n_layer)*(32*hparams.n_embd + 4*hparams.n_head*n_ctx) + 2*hparams.n_vocab)*sizeof(float);
+        std::unique_ptr<uint8_t[]> buf(new uint8_t[bound]);
+
+        struct ggml_init_params params = {
+            .mem_size   = bound,
+            .mem_buffer = buf.get(),
+        };
+
+        auto graph = std::make_unique<gptj_graph>();
+        graph->ctx = ggml_init(params);
+        gptj_build_graph(model, *graph, std::max(0, n_ctx - n), std::vector<gpt_vocab::id>(n, 0), {all_logits});
+        return ggml_used_mem(graph->ctx);
+    });
+
+    return buf_size;
+}
+
+// returns the graph evaluating token after n_past tokens
+// it's built once for the end of the context, so its tensors are large enough for any n_past, and then adjusted in place
+static gptj_graph & gptj_decode_graph(gptj_model & model, const int n_past, const gpt_vocab::id token) {
+    auto & graph = model.decode_graph;
+
+    if (!graph) {
+        model.decode_buf.resize(gptj_eval_buf_size(model, 1));
+
+        struct ggml_init_params params = {
+            .mem_size   = model.decode_buf.size,
+            .mem_buffer = model.decode_buf.addr,
+        };
+
+        graph = std::make_unique<gptj_graph>();
+        graph->ctx = ggml_init(params);
+        graph->reusable = true;
+        gptj_build_graph(model, *graph, model.kv_self.n_ctx_max - 1, {token});
+    }
+
+    for (const auto & update : graph->n_past_updates) {
+        update(n_past);
+    }
+    ((int32_t *) graph->embd->data)[0] = token;
+
+    return *graph;
+}
+
+// evaluate the transformer
+//
+//   - model:     the model
+//   - n_threads: number of threads to use
+//   - n_past:    the context size so far
+//   - embd_inp:  the embeddings of the tokens in the context
+//   - embd_w:    the predicted logits for the next token, or for every token if logits.all_tokens is set
+//   - parallel_branches: compute attention and feed-forward of each layer concurrently on split thread groups
+//   - logits:    the logits to compute; just those of the requested tokens if logits.tokens is given
+//
+bool gptj_eval(
+        gptj_model & model,
+        const int n_threads,
+        const int n_past,
+        const std::vector<gpt_vocab::id> & embd_inp,
+              std::vector<float>         & embd_w,
+              bool                         parallel_branches,
+        const g4a_logits_spec            & logits) {
+    const int N = embd_inp.size();
+
+    const auto & hparams = model.hparams;
+
+    const int n_layer = hparams.n_layer;
+    const int n_vocab = hparams.n_vocab;
+
+    if (!g4a_logits_valid(logits, n_vocab)) {
+        return false;
+    }
+
+    if (N == 0 || n_past < 0 || n_past + N > model.kv_self.n_ctx_max) {
+        fprintf(stderr, "%s: %d tokens after %d don't fit into the cache\n", __func__, N, n_past);
+        return false;
+    }
+
+    // grow the KV cache if it has no room for the new tokens yet
+    if (!kv_cache_reserve(model, model.kv_self, n_past + N)) {
+        return false;
+    }
+
+    // single tokens reuse the decode graph of the model; batches, and single tokens whose logits are restricted
+    // to some tokens, are built in a buffer shared with other instances that aren't evaluating right now
+    std::unique_ptr<g4a_compute_buffer> buf;
+    std::unique_ptr<gptj_graph> batch_graph;
+    if (N != 1 || !logits.tokens.empty()) {
+        buf = std::make_unique<g4a_compute_buffer>(gptj_eval_buf_size(model, N, logits.all_tokens));
+
+        struct ggml_init_params params = {
+            .mem_size   = buf->size(),
+            .mem_buffer = buf->addr(),
+        };
+
+        batch_graph = std::make_unique<gptj_graph>();
+        batch_graph->ctx = ggml_init(params);
+        gptj_build_graph(model, *batch_graph, n_past, embd_inp, logits);
+    }
+    auto & graph = batch_graph ? *batch_graph : gptj_decode_graph(model, n_past, embd_inp[0]);
+
+    struct ggml_context * ctx0 = graph.ctx;
+    auto & gf = graph.gf;
+    const auto & ops = graph.ops;
+
+    // the branches are only split for small batches; from 32 rows on ggml may use BLAS, which needs much larger work buffers
+    parallel_branches = parallel_branches && n_threads > 1 && N < 32;
 
     // run the computation
-    ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute       (ctx0, &gf);
+    if (!parallel_branches) {
+        g4a_graph_compute(ctx0, gf, ops, n_threads);
+    } else {
+        // the feed-forward branch streams twice as many weights as the attention branch
+        const int n_threads_ffn  = std::max(1, n_threads*2/3);
+        const int n_threads_attn = std::max(1, n_threads - n_threads_ffn);
+
+        // each branch uses the work buffer of the thread computing it
+        const size_t work_size = g4a_graph_work_size(gf, n_threads);
+        struct ggml_tensor * work_main = g4a_graph_work(work_size);
+
+        auto graph_main = std::make_unique<ggml_cgraph>();
+        auto graph_ffn  = std::make_unique<ggml_cgraph>();
+
+        g4a_graph_pos pos = {0, 0};
+        for (int il = 0; il < n_layer; ++il) {
+            const auto & attn_range = graph.attn_range[il];
+            const auto & ffn_range  = graph.ffn_range[il];
+
+            // norm, residual adds of the previous layer
+            g4a_graph_compute_range(ctx0, gf, ops, *graph_main, pos, attn_range.first, n_threads, work_main);
+
+            // attention and feed-forward at once; the feed-forward branch runs on a persistent worker of the shared compute pool
+            LM::ComputePool::get().run_parallel(2, [&] (unsigned ith, unsigned) {
+                if (ith == 0) {
+                    g4a_graph_compute_range(ctx0, gf, ops, *graph_main, attn_range.first, attn_range.second, n_threads_attn, work_main);
+                } else {
+                    g4a_graph_compute_range(ctx0, gf, ops, *graph_ffn, ffn_range.first, ffn_range.second, n_threads_ffn, g4a_graph_work(work_size));
+                }
+            });
+
+            pos = ffn_range.second;
+        }
+        // final norm and lm_head
+        g4a_graph_compute_range(ctx0, gf, ops, *graph_main, pos, g4a_graph_position(gf, ops), n_threads, work_main);
+    }
+
+    model.kv_self.n = n_past + N;
 
     //if (n_past%100 == 0) {
     //    ggml_graph_print   (&gf);
     //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
     //}
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+    // return result for the requested tokens, by default just the last one
+    const size_t n_logits = logits.tokens.empty() ? n_vocab : logits.tokens.size();
+    embd_w.resize(n_logits*(logits.all_tokens ? N : 1));
+    memcpy(embd_w.data(), ggml_get_data(graph.logits), sizeof(float)*embd_w.size());
+
+    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    return true;
+}
 
-    if (mem_per_token == 0 && N != 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
+// allocates an empty cache for another sequence of model, of the same types and size limits as the model's own one
+bool gptj_kv_cache_shrink(gptj_model & model) {
+    auto & kv_self = model.kv_self;
+    if (!kv_self.n_chunk) {
+        return true;
+    }
+
+    const int n_ctx = std::min(kv_self.n_chunk, kv_self.n_ctx_max);
+    kv_self.n = std::min(kv_self.n, n_ctx);
+    return kv_self.n_ctx <= n_ctx || kv_cache_resize(model, kv_self, n_ctx);
+}
+
+bool gptj_kv_cache_create(const gptj_model & model, gptj_kv_cache & cache) {
+    const auto & kv_self = model.kv_self;
+
+    cache.n_ctx_max = kv_self.n_ctx_max;
+    cache.n_chunk   = kv_self.n_chunk;
+
+    return kv_cache_init(model.hparams, cache, kv_self.k->type, kv_self.v->type, cache.n_chunk ? std::min(cache.n_chunk, cache.n_ctx_max) : cache.n_ctx_max);
+}
+
+// evaluate the tokens of several sequences at once
+// the weights are read once for all of them, which is what limits decoding single tokens, while each sequence
+// attends to its own KV cache only
+//
+//   - model:     the model
+//   - n_threads: number of threads to use
+//   - seqs:      the sequences; each gets the logits of its last token, or of all its tokens if logits.all_tokens is set
+//   - logits:    the logits to compute; just those of the requested tokens if logits.tokens is given
+//
+bool gptj_eval_sequences(
+        gptj_model & model,
+        const int n_threads,
+        std::vector<gptj_sequence> & seqs,
+        const g4a_logits_spec & logits) {
+    const int n_vocab = model.hparams.n_vocab;
+    const int n_layer = model.hparams.n_layer;
+
+    if (!g4a_logits_valid(logits, n_vocab)) {
+        return false;
+    }
+
+    // gather the tokens of all sequences, making room for them in their caches
+    std::vector<gptj_graph_seq> graph_seqs;
+    std::vector<gpt_vocab::id> embd_inp;
+    for (auto & seq : seqs) {
+        auto & kv = seq.kv ? *seq.kv : model.kv_self;
+
+        const int N = seq.tokens.size();
+        if (N == 0 || seq.n_past < 0 || seq.n_past + N > kv.n_ctx_max) {
+            fprintf(stderr, "%s: %d tokens after %d don't fit into the cache of their sequence\n", __func__, N, seq.n_past);
+            return false;
+        }
+        for (const auto & other : graph_seqs) {
+            if (other.kv == &kv) {
+                fprintf(stderr, "%s: sequences can't share a cache\n", __func__);
+                return false;
+            }
+        }
+        if (!kv_cache_reserve(model, kv, seq.n_past + N)) {
+            return false;
+        }
+
+        graph_seqs.push_back({&kv, seq.n_past, N});
+        embd_inp.insert(embd_inp.end(), seq.tokens.begin(), seq.tokens.end());
+    }
+    if (graph_seqs.empty()) {
+        return true;
     }
-    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
-    ggml_free(ctx0);
+    const int N = embd_inp.size();
+
+    // the graph is at most as large as the one of a single sequence of all tokens at the end of the context with
+    // the logits of all of them, plus the tensors the attention of each further sequence adds: the 4 views of its
+    // rows and the 25 tensors of gptj_build_attention, counting the parameters of rope and diag_mask_inf
+    constexpr size_t n_seq_tensors = 4 + 25;
+    g4a_compute_buffer buf(gptj_eval_buf_size(model, N, true) + graph_seqs.size()*n_layer*n_seq_tensors*g4a_tensor_overhead);
+
+    struct ggml_init_params params = {
+        .mem_size   = buf.size(),
+        .mem_buffer = buf.addr(),
+    };
+
+    gptj_graph graph;
+    graph.ctx = ggml_init(params);
+    gptj_build_graph(model, graph, graph_seqs, embd_inp, logits);
+
+    // run the computation
+    g4a_graph_compute(graph.ctx, graph.gf, graph.ops, n_threads);
+
+    // return results by sequence
+    const size_t n_logits = logits.tokens.empty() ? n_vocab : logits.tokens.size();
+    const float * out = (const float *) ggml_get_data(graph.logits);
+    for (size_t i = 0; i < seqs.size(); i++) {
+        auto & seq = seqs[i];
+        (seq.kv ? *seq.kv : model.kv_self).n = seq.n_past + graph_seqs[i].N;
+
+        seq.logits.assign(out, out + n_logits*(logits.all_tokens ? graph_seqs[i].N : 1));
+        out += seq.logits.size();
+    }
 
     return true;
 }
 
 #define GPTJ_MAX_RNG_STATE 64*1024
 
+// states begin with these; ones saved before they had a version begin with the size of the rng state instead
+#define GPTJ_STATE_MAGIC   0x67736a74
+#define GPTJ_STATE_VERSION 2 // 1 stored the whole F32 cache buffer
+
+// size of the KV cache in states: the types of keys and values, then the keys and values of the cached tokens per layer
+// it doesn't depend on how many tokens the cache has room for, and states saved with other types are converted
+static size_t kv_state_size(const gptj_model & model) {
+    const auto & kv_self = model.kv_self;
+    const size_t n_elements = size_t(kv_self.n)*model.hparams.n_embd;
+    return 2*sizeof(int32_t) + model.hparams.n_layer*(g4a_row_size(kv_self.k->type, n_elements) + g4a_row_size(kv_self.v->type, n_elements));
+}
+
+// returns true if the KV cache can be stored as given type
+static bool kv_type_valid(int32_t type) {
+    return type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || type == GGML_TYPE_Q8_0;
+}
+
+// rotates the keys of a token at position p the way ggml_rope does in mode 0
+static void rope_keys(float * keys, int n_head, int n_embd_head, int n_rot, int p) {
+    const float theta_scale = powf(10000.0f, -2.0f/n_rot);
+
+    for (int h = 0; h < n_head; h++) {
+        float * x = keys + size_t(h)*n_embd_head;
+        float theta = float(p);
+
+        for (int i0 = 0; i0 < n_rot; i0 += 2) {
+            const float cos_theta = cosf(theta);
+            const float sin_theta = sinf(theta);
+            theta *= theta_scale;
+
+            const float x0 = x[i0];
+            const float x1 = x[i0 + 1];
+            x[i0]     = x0*cos_theta - x1*sin_theta;
+            x[i0 + 1] = x0*sin_theta + x1*cos_theta;
+        }
+    }
+}
+
+// restores the KV cache from a state saved before version 2, which stored the whole F32 cache buffer: a ggml context
+// with the keys, then the values, of as many tokens per layer as the buffer had room for
+// unversioned states have the keys unrotated and the values by position, version 1 stores them like the cache does now
+static bool set_legacy_kv_data(gptj_model & model, uint32_t version, const uint8_t * in, size_t size, size_t kv_size, int kv_ntok) {
+    auto & kv_self = model.kv_self;
+    const int n_embd  = model.hparams.n_embd;
+    const int n_layer = model.hparams.n_layer;
+    const int n_head  = model.hparams.n_head;
+
+    const size_t ctx_size = 2*size_t(n_layer)*n_embd*sizeof(float);
+    if (kv_size > size || kv_size < 2_MiB || (kv_size - 2_MiB) % ctx_size != 0) {
+        fprintf(stderr, "%s: kv cache has wrong size in state: got %zu\n", __func__, kv_size);
+        return false;
+    }
+    const size_t n_ctx = (kv_size - 2_MiB)/ctx_size;
+    if (kv_ntok < 0 || size_t(kv_ntok) > n_ctx || kv_ntok > kv_self.n_ctx_max) {
+        fprintf(stderr, "%s: %d tokens don't fit into the cache\n", __func__, kv_ntok);
+        return false;
+    }
+
+    // a growable cache may need more room first
+    if (!kv_cache_reserve(model, kv_self, kv_ntok) || kv_ntok > kv_self.n_ctx) {
+        fprintf(stderr, "%s: failed to grow the kv cache to %d tokens\n", __func__, kv_ntok);
+        return false;
+    }
+
+    // the data of each tensor follows its object header and the tensor itself and is padded to 16 bytes
+    const size_t tensor_size = n_ctx*n_layer*n_embd*sizeof(float);
+    const uint8_t * k_data = in + g4a_object_size + sizeof(struct ggml_tensor);
+    const uint8_t * v_data = k_data + (tensor_size + 15)/16*16 + g4a_object_size + sizeof(struct ggml_tensor);
+
+    // the state may not be aligned for floats, so rows are copied out first
+    std::vector<float> keys(size_t(kv_ntok)*n_embd);
+    std::vector<float> values(kv_ntok);
+    const size_t es_v = ggml_element_size(kv_self.v);
+
+    for (int il = 0; il < n_layer; il++) {
+        memcpy(keys.data(), k_data + sizeof(float)*il*n_ctx*n_embd, sizeof(float)*keys.size());
+        if (version == 0) {
+            for (int pos = 0; pos < kv_ntok; pos++) {
+                rope_keys(keys.data() + size_t(pos)*n_embd, n_head, n_embd/n_head, model.hparams.n_rot, pos);
+            }
+        }
+        g4a_convert_row(GGML_TYPE_F32, keys.data(), kv_self.k->type, (char *) kv_self.k->data + g4a_row_size(kv_self.k->type, size_t(il)*kv_self.n_ctx*n_embd), keys.size());
+
+        // values are transposed into rows of positions
+        if (version == 0) {
+            memcpy(keys.data(), v_data + sizeof(float)*il*n_ctx*n_embd, sizeof(float)*keys.size());
+        }
+        for (int i = 0; i < n_embd; i++) {
+            if (version == 0) {
+                for (int pos = 0; pos < kv_ntok; pos++) {
+                    values[pos] = keys[size_t(pos)*n_embd + i];
+                }
+            } else {
+                memcpy(values.data(), v_data + sizeof(float)*(size_t(il)*n_embd + i)*n_ctx, sizeof(float)*values.size());
+            }
+            g4a_convert_row(GGML_TYPE_F32, values.data(), kv_self.v->type, (char *) kv_self.v->data + es_v*(size_t(il)*n_embd + i)*kv_self.n_ctx, kv_ntok);
+        }
+    }
+
+    kv_self.n = kv_ntok;
+    return true;
+}
+
 size_t gptj_get_state_size(const gptj_model &model)
 {
     // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
     // for reference, std::mt19937(1337) serializes to 6701 bytes.
+    const size_t s_magic           = sizeof(uint32_t);
+    const size_t s_version         = sizeof(uint32_t);
     const size_t s_rng_size        = sizeof(size_t);
     const size_t s_rng             = GPTJ_MAX_RNG_STATE;
     const size_t s_kv_size         = sizeof(size_t);
     const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
+    const size_t s_kv              = kv_state_size(model);
     const size_t s_total = (
+        + s_magic
+        + s_version
         + s_rng_size
         + s_rng
         + s_kv_size
@@ -630,6 +1257,14 @@ size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, ui
 {
     uint8_t * out = dest;
     fflush(stdout);
+    // copy layout version
+    {
+        const uint32_t magic   = GPTJ_STATE_MAGIC;
+        const uint32_t version = GPTJ_STATE_VERSION;
+        memcpy(out, &magic,   sizeof(magic));   out += sizeof(magic);
+        memcpy(out, &version, sizeof(version)); out += sizeof(version);
+    }
+
     // copy rng
     {
         std::stringstream rng_ss;
@@ -647,14 +1282,31 @@ size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, ui
 
     // copy kv cache
     {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
+        const auto & kv_self = model.kv_self;
+
+        const size_t kv_size = kv_state_size(model);
+        const int    kv_ntok = kv_self.n;
 
         memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
         memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
 
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
+        const int32_t type_k = kv_self.k->type;
+        const int32_t type_v = kv_self.v->type;
+        memcpy(out, &type_k, sizeof(type_k)); out += sizeof(type_k);
+        memcpy(out, &type_v, sizeof(type_v)); out += sizeof(type_v);
+
+        const int n_embd = model.hparams.n_embd;
+        const size_t es_v = ggml_element_size(kv_self.v);
+
+        for (int il = 0; il < model.hparams.n_layer; il++) {
+            // keys of the cached tokens
+            const size_t k_size = g4a_row_size(kv_self.k->type, size_t(kv_ntok)*n_embd);
+            memcpy(out, (char *) kv_self.k->data + g4a_row_size(kv_self.k->type, size_t(il)*kv_self.n_ctx*n_embd), k_size); out += k_size;
+
+            // values of the cached tokens, in rows of positions
+            for (int i = 0; i < n_embd; i++) {
+                memcpy(out, (char *) kv_self.v->data + es_v*(size_t(il)*n_embd + i)*kv_self.n_ctx, es_v*kv_ntok); out += es_v*kv_ntok;
+            }
         }
     }
 
@@ -663,9 +1315,40 @@ size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, ui
     return written;
 }
 
-size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src)
+size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src, size_t size)
 {
     const uint8_t * in = src;
+    const uint8_t * end = src + size;
+
+    // the fixed size part from the rng up to the number of cached tokens
+    const size_t s_header = sizeof(size_t) + GPTJ_MAX_RNG_STATE + sizeof(size_t) + sizeof(int);
+    if (size < s_header) {
+        fprintf(stderr, "%s: state is truncated\n", __func__);
+        return 0;
+    }
+
+    // check layout version; states without one are converted like older versions
+    uint32_t version = 0;
+    {
+        uint32_t magic;
+        memcpy(&magic, in, sizeof(magic));
+
+        if (magic == GPTJ_STATE_MAGIC) {
+            in += sizeof(magic);
+            memcpy(&version, in, sizeof(version)); in += sizeof(version);
+
+            if (version == 0 || version > GPTJ_STATE_VERSION) {
+                fprintf(stderr, "%s: state was saved by an incompatible version\n", __func__);
+                return 0;
+            }
+        }
+
+        // followed by the types of the kv cache since version 2
+        if (size_t(end - in) < s_header + (version == GPTJ_STATE_VERSION ? 2*sizeof(int32_t) : 0)) {
+            fprintf(stderr, "%s: state is truncated\n", __func__);
+            return 0;
+        }
+    }
 
     // set rng
     {
@@ -675,11 +1358,21 @@ size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *
         memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
         memcpy(&rng_buf[0], in, GPTJ_MAX_RNG_STATE); in += GPTJ_MAX_RNG_STATE;
 
+        if (rng_size > GPTJ_MAX_RNG_STATE) {
+            fprintf(stderr, "%s: invalid rng state\n", __func__);
+            return 0;
+        }
+
+        std::mt19937 rng_new;
         std::stringstream rng_ss;
         rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
+        rng_ss >> rng_new;
 
-        assert(rng_ss.fail() == false);
+        if (rng_ss.fail()) {
+            fprintf(stderr, "%s: invalid rng state\n", __func__);
+            return 0;
+        }
+        *rng = rng_new;
     }
 
     // set kv cache
@@ -690,20 +1383,58 @@ size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *
         memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
         memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
 
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
+        if (version < GPTJ_STATE_VERSION) {
+            if (!set_legacy_kv_data(*model, version, in, end - in, kv_size, kv_ntok)) {
+                return 0;
+            }
+            in += kv_size;
+        } else {
+            int32_t type_k;
+            int32_t type_v;
 
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
+            memcpy(&type_k, in, sizeof(type_k)); in += sizeof(type_k);
+            memcpy(&type_v, in, sizeof(type_v)); in += sizeof(type_v);
 
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
+            auto & kv_self = model->kv_self;
+            const int n_embd = model->hparams.n_embd;
 
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
+            // values are stored transposed, so they are never quantized
+            if (!kv_type_valid(type_k) || n_embd % ggml_blck_size(ggml_type(type_k)) != 0 || (type_v != GGML_TYPE_F32 && type_v != GGML_TYPE_F16)) {
+                fprintf(stderr, "%s: unsupported kv cache types %d and %d\n", __func__, type_k, type_v);
+                return 0;
+            }
+            if (kv_ntok < 0 || kv_ntok > kv_self.n_ctx_max) {
+                fprintf(stderr, "%s: %d tokens don't fit into the cache\n", __func__, kv_ntok);
+                return 0;
+            }
 
-        }
+            const size_t n_elements = size_t(kv_ntok)*n_embd;
+            const size_t kv_size_expected = 2*sizeof(int32_t) + model->hparams.n_layer*(g4a_row_size(ggml_type(type_k), n_elements) + g4a_row_size(ggml_type(type_v), n_elements));
+            if (kv_size != kv_size_expected || kv_size - 2*sizeof(int32_t) > size_t(end - in)) {
+                fprintf(stderr, "%s: kv cache has wrong size in state: got %zu, expected %zu\n", __func__, kv_size, kv_size_expected);
+                return 0;
+            }
+
+            // a growable cache may need more room first
+            if (!kv_cache_reserve(*model, kv_self, kv_ntok) || kv_ntok > kv_self.n_ctx) {
+                fprintf(stderr, "%s: failed to grow the kv cache to %d tokens\n", __func__, kv_ntok);
+                return 0;
+            }
+
+            const size_t es_v = ggml_element_size(kv_self.v);
+
+            for (int il = 0; il < model->hparams.n_layer; il++) {
+                g4a_convert_row(ggml_type(type_k), in, kv_self.k->type, (char *) kv_self.k->data + g4a_row_size(kv_self.k->type, size_t(il)*kv_self.n_ctx*n_embd), size_t(kv_ntok)*n_embd);
+                in += g4a_row_size(ggml_type(type_k), size_t(kv_ntok)*n_embd);
 
-        model->kv_self.n = kv_ntok;
+                for (int i = 0; i < n_embd; i++) {
+                    g4a_convert_row(ggml_type(type_v), in, kv_self.v->type, (char *) kv_self.v->data + es_v*(size_t(il)*n_embd + i)*kv_self.n_ctx, kv_ntok);
+                    in += g4a_row_size(ggml_type(type_v), kv_ntok);
+                }
+            }
+
+            kv_self.n = kv_ntok;
+        }
     }
 
     const size_t nread = in - src;
@@ -3,9 +3,12 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <functional>
 #include <ggml.h>
 
 #include "../g4a_common.hpp"
+#include "../g4a_ops.hpp"
 
 
 // default hparams (GPT-J 6B)
@@ -25,7 +28,9 @@ struct gptj_layer {
     struct ggml_tensor * ln_1_b;
 
     // attention
-    struct ggml_tensor * c_attn_q_proj_w;
+    struct ggml_tensor * c_attn_qkv_w; // q, k and v projections packed into one matrix
+
+    struct ggml_tensor * c_attn_q_proj_w; // views into c_attn_qkv_w
     struct ggml_tensor * c_attn_k_proj_w;
     struct ggml_tensor * c_attn_v_proj_w;
 
@@ -62,7 +67,11 @@ struct gptj_kv_cache {
 
     gptj_buffer buf;
 
-    int n; // number of tokens currently in the cache
+    int n = 0; // number of tokens currently in the cache
+
+    int n_ctx     = 0; // number of tokens per layer there is room for
+    int n_ctx_max = 0; // number of tokens per layer it may grow to
+    int n_chunk   = 0; // number of tokens it grows by at once; 0 if it's allocated for n_ctx_max up front
 
     ~gptj_kv_cache() {
         if (ctx) {
@@ -71,6 +80,40 @@ struct gptj_kv_cache {
     }
 };
 
+// tokens of one sequence in a graph; they attend to the cache of their sequence only
+struct gptj_graph_seq {
+    const gptj_kv_cache * kv;
+    int n_past;
+    int N;
+};
+
+// graph of one evaluation
+struct gptj_graph {
+    struct ggml_context * ctx = NULL; // context the graph is built in
+
+    struct ggml_cgraph gf = {};
+
+    // work computed outside of ggml in between the graph nodes
+    g4a_graph_ops ops;
+
+    // ranges of the attention and feed-forward branches of each layer
+    std::vector<std::pair<g4a_graph_pos, g4a_graph_pos>> attn_range;
+    std::vector<std::pair<g4a_graph_pos, g4a_graph_pos>> ffn_range;
+
+    struct ggml_tensor * embd   = nullptr;
+    struct ggml_tensor * logits = nullptr;
+
+    // adjustments of the tensors depending on n_past, recorded if the graph is built to be reused
+    bool reusable = false;
+    std::vector<std::function<void (int n_past)>> n_past_updates;
+
+    ~gptj_graph() {
+        if (ctx) {
+            ggml_free(ctx);
+        }
+    }
+};
+
 struct gptj_model {
     gptj_hparams hparams;
 
@@ -85,6 +128,8 @@ struct gptj_model {
 
     std::vector<gptj_layer> layers;
 
+    bool repacked = false; // quantized weights were rearranged by g4a_repack where supported
+
     // key + value memory
     struct gptj_kv_cache kv_self;
 
@@ -92,20 +137,47 @@ struct gptj_model {
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
 
-    gptj_buffer buf;
+    gptj_buffer weights_buf; // memory of ctx, holding the weights that are read
+
+    std::unique_ptr<g4a_mmap> mapping; // model file, if weights point into it
+    struct ggml_context * ctx_mapped = NULL; // headers of the mapped weights
+
+    std::map<std::pair<int, bool>, size_t> eval_buf_sizes; // compute buffer size by batch size and whether all logits are computed, measured on first use
+
+    // graph evaluating single tokens, built on first use and adjusted to n_past for every token
+    gptj_buffer decode_buf;
+    std::unique_ptr<gptj_graph> decode_graph;
 
     ~gptj_model() {
         if (ctx) {
             ggml_free(ctx);
         }
+        if (ctx_mapped) {
+            ggml_free(ctx_mapped);
+        }
     }
 };
 
 
-bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & model, gpt_vocab & vocab);
-bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab);
-bool gptj_eval(gptj_model& model, const int n_threads, const int n_past, const std::vector<gpt_vocab::id>& embd_inp, std::vector<float>& embd_w, size_t& mem_per_token);
+bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & model, gpt_vocab & vocab, int n_ctx = 0, int n_ctx_chunk = 0, ggml_type kv_type = GGML_TYPE_F32, const g4a_mmap_params & mmap_params = {}, const g4a_load_progress & progress = nullptr);
+bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab, int n_ctx = 0, int n_ctx_chunk = 0, ggml_type kv_type = GGML_TYPE_F32, const g4a_mmap_params & mmap_params = {}, const g4a_load_progress & progress = nullptr);
+size_t gptj_eval_buf_size(gptj_model& model, const int N, bool all_logits = false);
+bool gptj_eval(gptj_model& model, const int n_threads, const int n_past, const std::vector<gpt_vocab::id>& embd_inp, std::vector<float>& embd_w, bool parallel_branches = false, const g4a_logits_spec& logits = {});
+
+// one sequence of gptj_eval_sequences
+struct gptj_sequence {
+    gptj_kv_cache * kv = nullptr; // cache of the sequence, e.g. from gptj_kv_cache_create; the one of the model if null
+    int n_past = 0; // tokens already in kv
+    std::vector<gpt_vocab::id> tokens; // tokens to evaluate after them
+    std::vector<float> logits; // set to the logits of the last token, or of all tokens if requested
+};
+
+bool gptj_kv_cache_create(const gptj_model& model, gptj_kv_cache& cache);
+// shrinks the model's own cache back to room for one chunk of tokens if it is growable, dropping the tokens beyond
+bool gptj_kv_cache_shrink(gptj_model& model);
+bool gptj_eval_sequences(gptj_model& model, const int n_threads, std::vector<gptj_sequence>& seqs, const g4a_logits_spec& logits = {});
 size_t gptj_get_state_size(const gptj_model &model);
 size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, uint8_t *dest);
-size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src);
+// returns the number of bytes read from src, or 0 if the size bytes at src aren't a state model can take
+size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src, size_t size);
 #endif // GPTJ_HPP
@@ -6,6 +6,12 @@
 #include <functional>
 #include <memory>
 #include <thread>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#include "justlm_compute.hpp"
 
 #ifdef LM_NOEXCEPT
 #   define LM_NOEXCEPTDECL noexcept
@@ -44,6 +50,8 @@ using ssize_t = SSIZE_T;
 using GenerateCallback = std::function<bool (const char *generated)>;
 using AppendCallback = std::function<bool (float progress)>;
 
+class AsyncConstruction;
+
 class Inference {
 protected:
     AppendCallback on_scroll = nullptr;
@@ -57,12 +65,23 @@ public:
         using std::runtime_error::runtime_error;
     };
 
+    enum class KVType {
+        F32,
+        F16,
+        Q8 // 8 bit blocks of 32 values with a scale each where the backend supports it; F16 otherwise
+    };
+
     struct Params {
         int seed = 0; // RNG seed
-        unsigned n_threads = 0; // Amount of threads to use, immutable after Inference was constructed
+        unsigned n_threads = 0; // Amount of threads to use for generation; may be changed at any time, the shared ComputePool may grant less
+        unsigned n_threads_batch = 0; // Amount of threads to use for prompt evaluation; 0 to use n_threads; may be changed at any time
+        bool n_threads_autotune = false; // Benchmark generation and prompt evaluation during construction and choose n_threads and n_threads_batch from it
         unsigned n_ctx = 2024; // Context size
+        unsigned n_ctx_chunk = 0; // Allocate the KV cache in chunks of this many tokens as the context fills instead of all at once; 0 to allocate it up front; gptj and mpt specific
+        KVType kv_type = KVType::F16; // Element type of the KV cache; trades its memory and the bandwidth attention needs against precision
         unsigned n_ctx_window_top_bar = 0; // Top bar of context window. Must be smaller than context size
-        unsigned n_batch = 8; // Batch size
+        unsigned n_batch = 8; // Batch size; smallest batch size considered for prompt evaluation
+        bool n_batch_autotune = false; // Measure prompt evaluation throughput during construction and choose n_batch from it
         unsigned n_repeat_last = 0;
         unsigned n_eos_ignores = 0;
 
@@ -75,8 +94,13 @@ public:
         float mirostat_target_entropy = 5.0f; // mirostat specific
         float repeat_penalty = 1.0f;
 
+        int numa_node = -1; // NUMA node to bind compute threads to; KV cache, buffers and weights are then allocated on it too. -1 to not bind
+
         unsigned n_gpu_layers = 38;
-        bool use_mlock = true; // llama specific
+        bool use_mmap = false; // Point gptj and mpt weights straight into the model file where its layout allows instead of reading them, so processes share their pages; such weights aren't repacked for VNNI. llama always maps
+        bool mmap_populate = false; // Fault the whole mapping in during construction instead of on first use; gptj and mpt specific
+        bool use_mlock = true; // Lock the weights into memory
+        bool parallel_branches = false; // Evaluate attention and feed-forward of a layer concurrently on split thread groups during generation; gptj specific
         int prefer_mirostat = 0; // Use given mirostat version if available (see is_mirostat_available()); llama specific
     } params;
 
@@ -94,7 +118,8 @@ public:
     Inference(const Params& p) : params(p) {
         // Set random seed
         params.seed = params.seed?params.seed:time(NULL);
-        params.n_threads = params.n_threads?params.n_threads:(static_cast<unsigned>(std::thread::hardware_concurrency()) / 2);
+        params.n_threads = params.n_threads?params.n_threads:Topology::get().get_default_thread_count(params.numa_node);
+        params.n_threads_batch = params.n_threads_batch?params.n_threads_batch:params.n_threads;
     }
     virtual ~Inference() {}
     Inference(const Inference&) = delete;
@@ -105,8 +130,13 @@ public:
         o.generic_state = nullptr;
     }
 
+    // on_progress is called with the share of the weights loaded so far in percent, also between the phases before and
+    // after loading them; returning false cancels construction, which then fails like a failed load
     static
-    Inference *construct(const std::string& weights_path, const Params& p);
+    Inference *construct(const std::string& weights_path, const Params& p, const AppendCallback& on_progress = nullptr);
+    // Constructs on a thread of its own and returns right away; any number of constructions may run at once
+    static
+    AsyncConstruction construct_async(const std::string& weights_path, const Params& p, const AppendCallback& on_progress = nullptr);
 
     void set_scroll_callback(const AppendCallback& scroll_cb) noexcept {
         on_scroll = scroll_cb;
@@ -142,6 +172,47 @@ public:
 };
 
 
+// Handle of a construction started by Inference::construct_async()
+class AsyncConstruction {
+    friend class Inference;
+
+    // State shared with the constructing thread
+    struct Shared {
+        std::atomic<float> progress{0.f};
+        std::atomic<bool> cancelled{false};
+        std::mutex mutex;
+        bool abandoned = false; // The handle is gone, so the constructing thread deletes the result itself
+    };
+
+    std::shared_ptr<Shared> shared;
+    std::future<Inference *> result;
+
+    AsyncConstruction(std::shared_ptr<Shared> shared, std::future<Inference *> result)
+            : shared(std::move(shared)), result(std::move(result)) {}
+
+public:
+    AsyncConstruction(AsyncConstruction&&) = default;
+    // Cancels construction if the result wasn't taken; doesn't wait for it to stop
+    ~AsyncConstruction();
+
+    // Share of the weights loaded so far in percent
+    float get_progress() const noexcept {
+        return shared->progress;
+    }
+    // Makes construction fail at its next progress report, at the latest once the current phase is done
+    void cancel() noexcept {
+        shared->cancelled = true;
+    }
+    bool is_ready() const {
+        return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+    // Waits for construction and returns its result like Inference::construct(), rethrowing what it threw; may only be called once
+    Inference *get() {
+        return result.get();
+    }
+};
+
+
 struct Implementation {
     bool is_fallback = false;
 };
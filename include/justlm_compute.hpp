@@ -0,0 +1,143 @@
+#ifndef JUSTLM_COMPUTE_HPP
+#define JUSTLM_COMPUTE_HPP
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <utility>
+
+
+namespace LM {
+// CPU topology as visible to this process, detected once when the library is loaded
+struct Topology {
+    struct Node {
+        int id;
+        std::vector<unsigned> cpus; // Usable logical CPUs of this node
+        unsigned physical_cores;
+    };
+
+    std::vector<unsigned> cpus; // Logical CPUs in the processes affinity mask
+    unsigned physical_cores; // Physical cores among cpus
+    std::vector<Node> nodes; // NUMA nodes with at least one usable CPU
+    float cpu_quota = 0.0f; // cgroup CPU quota in CPUs; 0 if unlimited
+
+    static const Topology& get();
+
+    // Returns node with given ID or nullptr if there is no such usable node
+    const Node *get_node(int id) const;
+
+    // Amount of threads that may run at once without oversubscribing the CPU quota or affinity mask
+    unsigned get_usable_thread_count() const;
+    // Amount of threads to use by default; one per physical core (of given node unless -1), limited by the CPU quota
+    unsigned get_default_thread_count(int numa_node = -1) const;
+};
+
+
+// Binds the calling thread to the CPUs of given NUMA node until destroyed; does nothing for node -1
+// Memory first touched by the thread meanwhile ends up on that node, and ggml workers started by it are bound too
+class NumaBinding {
+    int node = -1;
+    int previous_node = -1;
+
+public:
+    NumaBinding(int node);
+    NumaBinding(const NumaBinding&) = delete;
+    NumaBinding(NumaBinding&& o) : node(std::exchange(o.node, -1)), previous_node(o.previous_node) {}
+    ~NumaBinding();
+
+    // Returns node the calling thread is currently bound to or -1
+    static int get_current_node();
+};
+
+
+// Process-wide pool of persistent compute threads shared by all inference instances and backends
+// Evaluations must acquire a lease before computing; the pool divides its threads among all active leases
+class ComputePool {
+public:
+    class Lease {
+        friend ComputePool;
+
+        ComputePool *pool = nullptr;
+        unsigned n_threads = 0;
+        NumaBinding binding;
+
+        Lease(ComputePool *pool, unsigned n_threads, int numa_node) : pool(pool), n_threads(n_threads), binding(numa_node) {}
+
+    public:
+        Lease(const Lease&) = delete;
+        Lease(Lease&& o) : pool(std::exchange(o.pool, nullptr)), n_threads(o.n_threads), binding(std::move(o.binding)) {}
+        ~Lease() {
+            if (pool) pool->release(n_threads);
+        }
+
+        // Amount of threads the evaluation holding this lease may use
+        unsigned get_thread_count() const {
+            return n_threads;
+        }
+    };
+
+private:
+    std::mutex mutex;
+    std::condition_variable tasks_cv;
+    std::condition_variable admission_cv;
+
+    std::deque<std::function<void ()>> tasks;
+    std::atomic<size_t> tasks_queued = 0; // Same as tasks.size(), but readable without locking
+    std::vector<std::thread> workers;
+    unsigned workers_idle = 0;
+    std::atomic<std::chrono::steady_clock::rep> spin_duration;
+
+    unsigned thread_limit;
+    unsigned threads_leased = 0;
+    unsigned leases_active = 0;
+    unsigned leases_waiting = 0;
+
+    ComputePool();
+
+    void worker_main();
+    void release(unsigned n_threads);
+
+public:
+    ComputePool(const ComputePool&) = delete;
+
+    static ComputePool& get();
+
+    // Limits the amount of threads leased at once; 0 to use all threads the topology allows
+    void set_thread_limit(unsigned n_threads);
+    unsigned get_thread_limit();
+
+    // Blocks until at least one thread is free, then leases up to n_threads threads
+    // No lease gets more than an even share of the limit among all active and waiting evaluations
+    // The calling thread and the workers it starts are bound to given NUMA node while the lease is held unless -1
+    Lease acquire(unsigned n_threads, int numa_node = -1);
+
+    // Runs given task on a persistent worker thread
+    // Never waits for a worker to become free; the pool grows instead
+    void run(std::function<void ()> task);
+
+    // Runs fnc(ith, n_threads) for every ith below n_threads and returns once all are done
+    // ith 0 runs on the calling thread, the others on workers bound to the calling threads NUMA node
+    // Takes no lease of its own; n_threads should come from the callers lease
+    void run_parallel(unsigned n_threads, const std::function<void (unsigned ith, unsigned nth)>& fnc);
+
+    // Creates worker threads until there are at least n_workers of them
+    void reserve(unsigned n_workers);
+
+    // Amount of worker threads created so far
+    size_t get_worker_count();
+
+    // Sets how long idle workers spin waiting for the next task before parking
+    // Spinning avoids waking parked threads between back-to-back graph computations during generation
+    void set_spin_duration(std::chrono::microseconds duration) {
+        spin_duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration).count();
+    }
+    std::chrono::microseconds get_spin_duration() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::duration(spin_duration.load()));
+    }
+};
+}
+#endif // JUSTLM_COMPUTE_HPP
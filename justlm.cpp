@@ -5,11 +5,12 @@
 #include <vector>
 #include <fstream>
 #include <filesystem>
+#include <mutex>
 
 
 
 static
-Dlhandle get_implementation(std::ifstream& input_f) {
+Dlhandle get_implementation(std::ifstream& input_f, const LM::AppendCallback& on_progress) {
     Dlhandle matching;
     Dlhandle fallback;
     // Iterate over all libraries
@@ -18,6 +19,10 @@ Dlhandle get_implementation(std::ifstream& input_f) {
         const auto& p = f.path();
         // Check extension
         if (p.extension() != LIB_FILE_EXT) continue;
+        // Check for cancellation before loading each, nothing is loaded yet
+        if (on_progress && !on_progress(0.f)) {
+            throw LM::Inference::Exception("Construction was cancelled");
+        }
         // Load library
         try {
             Dlhandle dl(p);
@@ -45,22 +50,69 @@ Dlhandle get_implementation(std::ifstream& input_f) {
     return fallback;
 }
 
-LM::Inference *LM::Inference::construct(const std::string &weights_path, const Params &p) {
+LM::Inference *LM::Inference::construct(const std::string &weights_path, const Params &p, const AppendCallback &on_progress) {
     static std::vector<Dlhandle> dls;
+    static std::mutex dls_mutex;
     // Read magic
     std::ifstream f(weights_path, std::ios::binary);
     if (!f) {
         throw Exception("Failed to open weights file for reading at "+weights_path);
     }
     // Get correct implementation
-    auto impl = get_implementation(f);
+    auto impl = get_implementation(f, on_progress);
     if (!impl) return nullptr;
     // Get inference constructor
-    auto constructor = impl.get<LM::Inference *(const std::string &, std::ifstream&, const LM::Inference::Params &)>("construct");
+    auto constructor = impl.get<LM::Inference *(const std::string &, std::ifstream&, const LM::Inference::Params &, const AppendCallback &)>("construct");
     if (!constructor) return nullptr;
     // Back up Dlhandle
-    dls.push_back(std::move(impl));
+    {
+        std::scoped_lock L(dls_mutex);
+        dls.push_back(std::move(impl));
+    }
     // Construct inference
     f.seekg(0);
-    return constructor(weights_path, f, p);
+    return constructor(weights_path, f, p, on_progress);
+}
+
+LM::AsyncConstruction LM::Inference::construct_async(const std::string &weights_path, const Params &p, const AppendCallback &on_progress) {
+    auto shared = std::make_shared<AsyncConstruction::Shared>();
+    std::promise<Inference *> promise;
+    auto result = promise.get_future();
+    // Detached, so dropping the handle never blocks on a callback that waits for its caller (e.g. for Pythons GIL)
+    std::thread([weights_path, p, on_progress, shared, promise = std::move(promise)] () mutable {
+        Inference *inference = nullptr;
+        std::exception_ptr error;
+        try {
+            inference = construct(weights_path, p, [&] (float progress) {
+                shared->progress = progress;
+                if (!shared->cancelled && on_progress && !on_progress(progress)) shared->cancelled = true;
+                return !shared->cancelled;
+            });
+        } catch (...) {
+            error = std::current_exception();
+        }
+        // Hand the result over unless nobody is left to take it
+        std::scoped_lock L(shared->mutex);
+        if (shared->abandoned) {
+            delete inference;
+        } else if (error) {
+            promise.set_exception(error);
+        } else {
+            promise.set_value(inference);
+        }
+    }).detach();
+    return {std::move(shared), std::move(result)};
+}
+
+LM::AsyncConstruction::~AsyncConstruction() {
+    if (!result.valid()) return;
+    cancel();
+    std::scoped_lock L(shared->mutex);
+    shared->abandoned = true;
+    // Delete the result if it was already handed over
+    if (is_ready()) {
+        try {
+            delete result.get();
+        } catch (...) {}
+    }
 }
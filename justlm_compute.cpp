@@ -0,0 +1,439 @@
+#include "justlm_compute.hpp"
+
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <set>
+#ifdef __linux__
+#   include <sched.h>
+#endif
+
+
+
+// Parses CPU lists like "0-3,8,10-11"
+static std::vector<unsigned> parse_cpu_list(const std::string& str) {
+    std::vector<unsigned> fres;
+    std::istringstream ss(str);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        try {
+            const auto dash = range.find('-');
+            const unsigned first = std::stoul(range.substr(0, dash));
+            const unsigned last = dash==range.npos?first:std::stoul(range.substr(dash+1));
+            for (unsigned cpu = first; cpu <= last; cpu++) {
+                fres.push_back(cpu);
+            }
+        } catch (...) {}
+    }
+    return fres;
+}
+
+static std::string read_first_line(const std::string& path) {
+    std::ifstream f(path);
+    std::string fres;
+    std::getline(f, fres);
+    return fres;
+}
+
+#ifdef __linux__
+// Returns the CPU quota of given cgroup directory in CPUs, 0 if unlimited or -1 if unknown
+static float read_cgroup_cpu_quota(const std::string& dir, bool v2) try {
+    if (v2) {
+        // Format: "$MAX $PERIOD" where $MAX may be "max"
+        std::istringstream cpu_max(read_first_line(dir+"/cpu.max"));
+        std::string quota;
+        double period;
+        if (!(cpu_max >> quota >> period)) return -1.0f;
+        if (quota == "max" || period <= 0.0) return 0.0f;
+        return std::stod(quota) / period;
+    } else {
+        const auto quota = read_first_line(dir+"/cpu.cfs_quota_us");
+        const auto period = read_first_line(dir+"/cpu.cfs_period_us");
+        if (quota.empty() || period.empty()) return -1.0f;
+        if (std::stod(quota) <= 0.0 || std::stod(period) <= 0.0) return 0.0f;
+        return std::stod(quota) / std::stod(period);
+    }
+} catch (...) {
+    return -1.0f;
+}
+
+// Returns the smallest CPU quota along the processes cgroup hierarchy in CPUs or 0 if unlimited
+static float detect_cpu_quota() {
+    float fres = 0.0f;
+    const auto update = [&fres] (float quota) {
+        if (quota > 0.0f && (fres == 0.0f || quota < fres)) fres = quota;
+    };
+    std::ifstream cgroup_f("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroup_f, line)) {
+        // Lines look like "$ID:$CONTROLLERS:$PATH"; $CONTROLLERS is empty for cgroup v2
+        const auto first_colon = line.find(':');
+        const auto second_colon = line.find(':', first_colon+1);
+        if (first_colon == line.npos || second_colon == line.npos) continue;
+        const auto controllers = line.substr(first_colon+1, second_colon-first_colon-1);
+        std::filesystem::path path = line.substr(second_colon+1);
+        std::string mount;
+        if (controllers.empty()) {
+            mount = "/sys/fs/cgroup";
+        } else {
+            // Check that this is the cpu controller
+            const auto controller_list = ','+controllers+',';
+            if (controller_list.find(",cpu,") == controller_list.npos) continue;
+            mount = "/sys/fs/cgroup/"+controllers;
+        }
+        // Walk up the hierarchy; inside containers the path may not be visible, so the mount itself is checked last
+        for (;; path = path.parent_path()) {
+            update(read_cgroup_cpu_quota(mount+path.string(), controllers.empty()));
+            if (path == path.parent_path()) break;
+        }
+        update(read_cgroup_cpu_quota(mount, controllers.empty()));
+    }
+    return fres;
+}
+#endif
+
+static LM::Topology detect_topology() {
+    LM::Topology fres;
+#   ifdef __linux__
+    // Get affinity mask
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (unsigned cpu = 0; cpu != CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) fres.cpus.push_back(cpu);
+        }
+    }
+#   endif
+    if (fres.cpus.empty()) {
+        for (unsigned cpu = 0; cpu != std::max(std::thread::hardware_concurrency(), 1u); cpu++) {
+            fres.cpus.push_back(cpu);
+        }
+    }
+    // Counts physical cores among given CPUs
+    const auto count_physical_cores = [] (const std::vector<unsigned>& cpus) -> unsigned {
+#       ifdef __linux__
+        std::set<std::string> cores;
+        for (const auto cpu : cpus) {
+            const auto dir = "/sys/devices/system/cpu/cpu"+std::to_string(cpu)+"/topology/";
+            const auto package_id = read_first_line(dir+"physical_package_id");
+            const auto core_id = read_first_line(dir+"core_id");
+            // Count CPUs with unknown topology as a core each
+            if (package_id.empty() || core_id.empty()) {
+                cores.insert("cpu"+std::to_string(cpu));
+            } else {
+                cores.insert(package_id+':'+core_id);
+            }
+        }
+        return cores.size();
+#       else
+        // Assume SMT
+        return std::max(static_cast<unsigned>(cpus.size()) / 2, 1u);
+#       endif
+    };
+    fres.physical_cores = count_physical_cores(fres.cpus);
+    // Get NUMA nodes
+#   ifdef __linux__
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        const auto name = entry.path().filename().string();
+        if (name.find("node") != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != name.npos) continue;
+        LM::Topology::Node node;
+        node.id = std::stoi(name.substr(4));
+        // Keep usable CPUs only
+        for (const auto cpu : parse_cpu_list(read_first_line(entry.path().string()+"/cpulist"))) {
+            if (std::find(fres.cpus.begin(), fres.cpus.end(), cpu) != fres.cpus.end()) node.cpus.push_back(cpu);
+        }
+        if (node.cpus.empty()) continue;
+        node.physical_cores = count_physical_cores(node.cpus);
+        fres.nodes.push_back(std::move(node));
+    }
+    std::sort(fres.nodes.begin(), fres.nodes.end(), [] (const auto& a, const auto& b) {
+        return a.id < b.id;
+    });
+    // Get CPU quota
+    fres.cpu_quota = detect_cpu_quota();
+#   endif
+    // Assume single node if detection failed
+    if (fres.nodes.empty()) {
+        fres.nodes.push_back({0, fres.cpus, fres.physical_cores});
+    }
+    return fres;
+}
+
+const LM::Topology &LM::Topology::get() {
+    static const Topology instance = detect_topology();
+    return instance;
+}
+// Detect as early as possible so the processes affinity mask isn't affected by any NumaBinding yet
+[[maybe_unused]] static const auto& topology_at_load = LM::Topology::get();
+
+const LM::Topology::Node *LM::Topology::get_node(int id) const {
+    for (const auto& node : nodes) {
+        if (node.id == id) return &node;
+    }
+    return nullptr;
+}
+
+unsigned LM::Topology::get_usable_thread_count() const {
+    unsigned fres = cpus.size();
+    if (cpu_quota > 0.0f) fres = std::min(fres, static_cast<unsigned>(cpu_quota));
+    return std::max(fres, 1u);
+}
+
+unsigned LM::Topology::get_default_thread_count(int numa_node) const {
+    const auto node = get_node(numa_node);
+    unsigned fres = node?node->physical_cores:physical_cores;
+    if (cpu_quota > 0.0f) fres = std::min(fres, static_cast<unsigned>(cpu_quota));
+    return std::max(fres, 1u);
+}
+
+
+static thread_local int current_numa_node = -1;
+
+// Binds the calling thread to given node or to all usable CPUs for -1
+static void bind_current_thread(int numa_node, bool force = false) {
+    if (numa_node == current_numa_node && !force) return;
+    const auto& topology = LM::Topology::get();
+    const auto node = topology.get_node(numa_node);
+#   ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : node?node->cpus:topology.cpus) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#   endif
+    current_numa_node = node?numa_node:-1;
+}
+
+LM::NumaBinding::NumaBinding(int node) : node(node) {
+    if (node < 0) return;
+    previous_node = current_numa_node;
+    bind_current_thread(node);
+}
+
+LM::NumaBinding::~NumaBinding() {
+    if (node < 0) return;
+    bind_current_thread(previous_node);
+}
+
+int LM::NumaBinding::get_current_node() {
+    return current_numa_node;
+}
+
+
+LM::ComputePool::ComputePool() {
+    set_thread_limit(0);
+    set_spin_duration(std::chrono::microseconds(500));
+}
+
+LM::ComputePool &LM::ComputePool::get() {
+    // Intentionally leaked so workers never have to be joined during static destruction
+    static auto *instance = new ComputePool;
+    return *instance;
+}
+
+// Busy waits until condition is met or the pools spin duration has passed
+template<typename ConditionFnc>
+static bool spin_wait(const LM::ComputePool& pool, const ConditionFnc& condition) {
+    const auto deadline = std::chrono::steady_clock::now() + pool.get_spin_duration();
+    for (unsigned it = 0; !condition(); it++) {
+        // Only check the clock every now and then
+        if (it % 64 == 0 && std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+void LM::ComputePool::worker_main() {
+    // Workers inherit the affinity of the thread that created them
+    bind_current_thread(-1, true);
+    std::unique_lock L(mutex);
+    for (;;) {
+        // Run next task if any
+        if (!tasks.empty()) {
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+            tasks_queued--;
+            L.unlock();
+            task();
+            L.lock();
+            continue;
+        }
+        workers_idle++;
+        // Spin for a while first since generation requests workers again right after joining them
+        L.unlock();
+        spin_wait(*this, [this] () {
+            return tasks_queued.load(std::memory_order_acquire) != 0;
+        });
+        L.lock();
+        // Park until a task arrives
+        if (tasks.empty()) {
+            tasks_cv.wait(L);
+        }
+        workers_idle--;
+    }
+}
+
+void LM::ComputePool::release(unsigned n_threads) {
+    {
+        std::scoped_lock L(mutex);
+        threads_leased -= n_threads;
+        leases_active--;
+    }
+    admission_cv.notify_all();
+}
+
+void LM::ComputePool::set_thread_limit(unsigned n_threads) {
+    {
+        std::scoped_lock L(mutex);
+        thread_limit = n_threads?n_threads:Topology::get().get_usable_thread_count();
+    }
+    admission_cv.notify_all();
+}
+
+unsigned LM::ComputePool::get_thread_limit() {
+    std::scoped_lock L(mutex);
+    return thread_limit;
+}
+
+LM::ComputePool::Lease LM::ComputePool::acquire(unsigned n_threads, int numa_node) {
+    std::unique_lock L(mutex);
+    // Wait for a free thread
+    leases_waiting++;
+    admission_cv.wait(L, [this] () {
+        return threads_leased < thread_limit;
+    });
+    leases_waiting--;
+    // Grant up to an even share
+    const unsigned fair_share = std::max(thread_limit / (leases_active + leases_waiting + 1), 1u);
+    n_threads = std::min({std::max(n_threads, 1u), thread_limit - threads_leased, fair_share});
+    // Don't exceed the nodes CPUs
+    if (const auto node = Topology::get().get_node(numa_node)) {
+        n_threads = std::min(n_threads, static_cast<unsigned>(node->cpus.size()));
+    }
+    threads_leased += n_threads;
+    leases_active++;
+    return Lease(this, n_threads, numa_node);
+}
+
+void LM::ComputePool::run(std::function<void ()> task) {
+    std::scoped_lock L(mutex);
+    tasks.push_back(std::move(task));
+    tasks_queued++;
+    // Wake up idle worker or create a new one if every worker is busy
+    if (tasks.size() > workers_idle) {
+        workers.emplace_back(&ComputePool::worker_main, this);
+    } else {
+        tasks_cv.notify_one();
+    }
+}
+
+void LM::ComputePool::run_parallel(unsigned n_threads, const std::function<void (unsigned, unsigned)>& fnc) {
+    if (n_threads <= 1) {
+        fnc(0, 1);
+        return;
+    }
+    // Lives on this stack, so workers must be done touching it before returning
+    struct {
+        std::atomic<unsigned> pending;
+        std::mutex mutex;
+        std::condition_variable cv;
+    } team;
+    team.pending = n_threads - 1;
+    for (unsigned ith = 1; ith < n_threads; ith++) {
+        run([&team, &fnc, ith, n_threads, numa_node = NumaBinding::get_current_node()] () {
+            bind_current_thread(numa_node);
+            fnc(ith, n_threads);
+            // Notify while locked since the calling thread returns as soon as it can
+            std::scoped_lock L(team.mutex);
+            if (team.pending.fetch_sub(1, std::memory_order_release) == 1) team.cv.notify_all();
+        });
+    }
+    fnc(0, n_threads);
+    // Parts are about equally large, so spin first
+    const bool done = spin_wait(*this, [&team] () {
+        return team.pending.load(std::memory_order_acquire) == 0;
+    });
+    // Taking the lock also makes sure the last worker is done touching team
+    std::unique_lock L(team.mutex);
+    if (!done) {
+        team.cv.wait(L, [&team] () {
+            return team.pending.load() == 0;
+        });
+    }
+}
+
+void LM::ComputePool::reserve(unsigned n_workers) {
+    std::scoped_lock L(mutex);
+    while (workers.size() < n_workers) {
+        workers.emplace_back(&ComputePool::worker_main, this);
+    }
+}
+
+size_t LM::ComputePool::get_worker_count() {
+    std::scoped_lock L(mutex);
+    return workers.size();
+}
+
+
+#ifndef _WIN32
+#include <pthread.h>
+
+// ggml spawns and joins fresh worker threads for every graph computation
+// Its ggml.c is compiled with pthread_create and pthread_join renamed to these, so they run on the compute pool instead
+// Nothing else calls them: ggml only ever joins the handles, which point to a PooledThread, and passes no attributes
+namespace {
+struct PooledThread {
+    void *(*start_routine)(void *);
+    void *arg;
+    void *result = nullptr;
+    std::atomic<bool> done = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    PooledThread(void *(*start_routine)(void *), void *arg) : start_routine(start_routine), arg(arg) {}
+};
+}
+
+extern "C" {
+int justlm_ggml_thread_create(pthread_t *thread, const pthread_attr_t *, void *(*start_routine)(void *), void *arg) {
+    auto *pooled = new PooledThread(start_routine, arg);
+    LM::ComputePool::get().run([pooled, numa_node = LM::NumaBinding::get_current_node()] () {
+        // Run on the same node as the thread that started the computation
+        bind_current_thread(numa_node);
+        pooled->result = pooled->start_routine(pooled->arg);
+        // Notify while locked since the joining thread deletes pooled as soon as it can
+        std::scoped_lock L(pooled->mutex);
+        pooled->done.store(true, std::memory_order_release);
+        pooled->cv.notify_all();
+    });
+    *thread = reinterpret_cast<pthread_t>(pooled);
+    return 0;
+}
+
+int justlm_ggml_thread_join(pthread_t thread, void **retval) {
+    auto *pooled = reinterpret_cast<PooledThread*>(thread);
+    // Workers of a graph computation finish at about the same time, so spin first
+    const bool done = spin_wait(LM::ComputePool::get(), [pooled] () {
+        return pooled->done.load(std::memory_order_acquire);
+    });
+    // Taking the lock also makes sure the worker is done touching pooled
+    {
+        std::unique_lock L(pooled->mutex);
+        if (!done) {
+            pooled->cv.wait(L, [pooled] () {
+                return pooled->done.load();
+            });
+        }
+    }
+    if (retval) *retval = pooled->result;
+    delete pooled;
+    return 0;
+}
+}
+#endif
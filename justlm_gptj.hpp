@@ -3,7 +3,11 @@
 #include <fstream>
 #include <random>
 #include <cstring>
+#include <chrono>
 #include "gptj/gptj.hpp"
+#include "justlm_prefill.hpp"
+#include "justlm_threads.hpp"
+#include "justlm_compute.hpp"
 #include "g4a_common.hpp"
 
 
@@ -11,13 +15,15 @@ namespace LM {
 class GPTJInference final : public Inference {
     std::string weights_path;
 
+    // Largest batch evaluated at once; activation memory grows linearly with it
+    static constexpr unsigned n_batch_max = 128;
+
     struct State {
         gpt_vocab vocab;
         gptj_model model;
         std::string prompt; // Mostly here for easy "debugging"
         std::vector<int> tokens;
         std::vector<float> logits;
-        size_t mem_per_token = 0;
         std::mt19937 rng;
 
         State(int32_t seed) : rng(seed) {}
@@ -30,22 +36,71 @@ class GPTJInference final : public Inference {
         return *reinterpret_cast<State* const*>(&generic_state);
     }
 
-    LM_ERRBOOL init(const std::string& _weights_path, std::ifstream& f) LM_NOEXCEPTDECL {
+    LM_ERRBOOL init(const std::string& _weights_path, std::ifstream& f, const AppendCallback& on_progress) LM_NOEXCEPTDECL {
         auto& state = get_state();
         weights_path = _weights_path;
 
+        // Allocate everything on the requested NUMA node
+        NumaBinding numa_binding(params.numa_node);
+
         // Allocate state
         state = new State(params.seed);
 
+        // Create compute pool workers ahead of time so the first evaluations don't have to
+        ComputePool::get().reserve(std::max(params.n_threads, params.n_threads_batch));
+
         // Load model
-        if (!gptj_model_load(weights_path, f, state->model, state->vocab)) {
+        const ggml_type kv_type = params.kv_type==KVType::F32?GGML_TYPE_F32:params.kv_type==KVType::F16?GGML_TYPE_F16:GGML_TYPE_Q8_0;
+        bool cancelled = false;
+        const auto progress = [&] (float share) {
+            cancelled = on_progress && !on_progress(share);
+            return !cancelled;
+        };
+        if (!gptj_model_load(weights_path, f, state->model, state->vocab, params.n_ctx, params.n_ctx_chunk, kv_type, {params.use_mmap, params.mmap_populate, params.use_mlock}, progress)) {
+            // Free what was loaded right away, the destructor doesn't run if this throws
+            deinit();
+            if (cancelled) {
+                LM_THROW("Loading gptj was cancelled", LM_BOOL_ERROR);
+            }
             LM_THROW("Failed to initialize gptj from file", LM_BOOL_ERROR);
         }
 
-        // Calculate memory required per token
-        static std::vector<gpt_vocab::id> p_instruct;
-        static std::vector<gpt_vocab::id> r_instruct;
-        gptj_eval(state->model, params.n_threads, 0, { 0, 1, 2, 3 }, state->logits, state->mem_per_token);
+        // Measure compute buffers of single tokens and full batches up front
+        gptj_eval_buf_size(state->model, 1);
+        gptj_eval_buf_size(state->model, params.n_batch);
+
+        // Optionally calibrate thread counts for generation and prompt evaluation
+        // Progress is reported again before each measurement, so construction can still be cancelled after loading
+        if (params.n_threads_autotune) {
+            const auto& topology = Topology::get();
+            const auto node = topology.get_node(params.numa_node);
+            const unsigned max_threads = std::min<unsigned>(node?node->cpus.size():topology.cpus.size(), topology.get_usable_thread_count());
+            // Measured under a lease like any evaluation, so other instances neither skew the measurements nor get starved
+            const auto lease = ComputePool::get().acquire(max_threads, params.numa_node);
+            params.n_threads = calibrate_threads(lease.get_thread_count(), [&] (unsigned n_threads) {
+                return progress(100.f) && gptj_eval(state->model, n_threads, 4, { 0 }, state->logits);
+            });
+            params.n_threads_batch = calibrate_threads(lease.get_thread_count(), [&] (unsigned n_threads) {
+                return progress(100.f) && gptj_eval(state->model, n_threads, 0, std::vector<int>(params.n_batch, 0), state->logits);
+            });
+        }
+
+        // Get prefill scheduler and optionally tune batch size
+        if (params.n_batch_autotune) {
+            const auto lease = ComputePool::get().acquire(params.n_threads_batch, params.numa_node);
+            params.n_batch = get_prefill_scheduler().autotune([&] (unsigned n_tokens) {
+                return progress(100.f) && gptj_eval(state->model, lease.get_thread_count(), 0, std::vector<int>(n_tokens, 0), state->logits);
+            });
+        }
+
+        // Measuring full batches may have grown a growable cache beyond what the context needs so far
+        gptj_kv_cache_shrink(state->model);
+
+        // The measurements stop early once cancelled
+        if (cancelled) {
+            deinit();
+            LM_THROW("Loading gptj was cancelled", LM_BOOL_ERROR);
+        }
 
         return LM_BOOL_SUCCESS;
     }
@@ -54,9 +109,21 @@ class GPTJInference final : public Inference {
 
         if (state) {
             delete state;
+            state = nullptr;
         }
     }
 
+    PrefillScheduler& get_prefill_scheduler() {
+        return PrefillScheduler::get("gptj", weights_path, params.n_threads_batch, params.n_batch, n_batch_max);
+    }
+
+    // Evaluates given tokens using threads leased from the shared compute pool
+    bool eval(size_t n_past, const std::vector<int>& tokens) {
+        auto& state = get_state();
+        const auto lease = ComputePool::get().acquire(tokens.size()==1?params.n_threads:params.n_threads_batch, params.numa_node);
+        return gptj_eval(state->model, lease.get_thread_count(), n_past, tokens, state->logits, params.parallel_branches);
+    }
+
     // This function reduces the size of our tokens vector according to some parameters
     // All tokens will be evaluated if scrolling was needed and true will be returned
     bool window_scroll() LM_NOEXCEPTDECL {
@@ -88,19 +155,24 @@ class GPTJInference final : public Inference {
     LM_ERRBOOL evaluate_tokens(size_t starting_offset, const AppendCallback &on_tick = nullptr) LM_NOEXCEPTDECL {
         auto& state = get_state();
 
-        // Evaluate tokens in batches
-        unsigned it;
-        for (it = starting_offset; ; it += params.n_batch) {
-            if (it + params.n_batch >= ssize_t(state->tokens.size())) break;
+        // Evaluate tokens in batches sized by the prefill scheduler
+        auto& prefill = get_prefill_scheduler();
+        size_t it = starting_offset;
+        while (it != state->tokens.size()) {
+            // Get batch size; the remainder is evaluated as a single batch
+            const unsigned n_batch = prefill.next_chunk(state->tokens.size()-it);
 
             // Evaluate
-            std::vector<int> batch(state->tokens.begin()+it, state->tokens.begin()+it+params.n_batch);
-            if (!gptj_eval(state->model, params.n_threads, it, batch, state->logits, state->mem_per_token)) {
+            std::vector<int> batch(state->tokens.begin()+it, state->tokens.begin()+it+n_batch);
+            const auto t_start = std::chrono::steady_clock::now();
+            if (!eval(it, batch)) {
                 LM_THROW("Failed to evaluate tokens in batches", LM_BOOL_ERROR);
             }
+            prefill.record(n_batch, std::chrono::steady_clock::now()-t_start);
+            it += n_batch;
 
             // Tick
-            if (on_tick) {
+            if (on_tick && it != state->tokens.size()) {
                 // Calculate progress
                 auto progress = float(it-starting_offset) / (state->tokens.size()-starting_offset) * 100.f;
                 // Tick and yield
@@ -108,17 +180,6 @@ class GPTJInference final : public Inference {
             }
         }
 
-        // Evaluate remaining tokens
-        if (it < state->tokens.size()) {
-            for (; it != state->tokens.size(); it++) {
-                //TODO: This is extremely inefficient! Don't do that...
-                std::vector<int> batch(state->tokens.begin()+it, state->tokens.begin()+it+1);
-                if (!gptj_eval(state->model, params.n_threads, it, batch, state->logits, state->mem_per_token)) {
-                    LM_THROW("Failed to evaluate individual tokens", LM_BOOL_ERROR);
-                }
-            }
-        }
-
         // Notify about completion
         if (on_tick) on_tick(100.f);
 
@@ -126,8 +187,8 @@ class GPTJInference final : public Inference {
     }
 
 public:
-    GPTJInference(const std::string& weights_path, std::ifstream& f, const Params& p) : Inference(p) {
-        init(weights_path, f);
+    GPTJInference(const std::string& weights_path, std::ifstream& f, const Params& p, const AppendCallback& on_progress) : Inference(p) {
+        init(weights_path, f, on_progress);
     }
     ~GPTJInference() LM_NOEXCEPTDECL override {
         deinit();
@@ -200,7 +261,7 @@ public:
                 // Evaluate token
                 //  TODO: Respect batch size
                 std::vector<int> batch(state->tokens.begin()+state->tokens.size()-1, state->tokens.begin()+state->tokens.size());
-                if (!gptj_eval(state->model, params.n_threads, state->tokens.size()-1, batch, state->logits, state->mem_per_token)) {
+                if (!eval(state->tokens.size()-1, batch)) {
                     LM_THROW("Failed to evaluate new tokens", "");
                 }
             }
@@ -235,7 +296,9 @@ public:
         auto& state = get_state();
         if (sv.ctx != generic_state)
             LM_THROW("Savestate does not match context", LM_BOOL_ERROR);
-        gptj_set_state_data(&state->model, &state->rng, sv.buf.data());
+        if (!gptj_set_state_data(&state->model, &state->rng, sv.buf.data(), sv.buf.size())) {
+            LM_THROW("Failed to restore state", LM_BOOL_ERROR);
+        }
         state->tokens = sv.tokens;
         state->prompt = sv.prompt;
         return LM_BOOL_SUCCESS;
@@ -293,7 +356,9 @@ public:
         if (!i.read(reinterpret_cast<char*>(state_buf.data()), state_buf.size())) {
             LM_THROW("Failed to deserialize state", LM_BOOL_ERROR);
         }
-        gptj_set_state_data(&state->model, &state->rng, state_buf.data());
+        if (!gptj_set_state_data(&state->model, &state->rng, state_buf.data(), state_buf.size())) {
+            LM_THROW("Failed to deserialize state", LM_BOOL_ERROR);
+        }
         return LM_BOOL_SUCCESS;
     }
     const std::string &get_prompt() const LM_NOEXCEPTDECL override {
@@ -1,9 +1,14 @@
 #include "justlm.hpp"
 
 #include <cstring>
+#include <chrono>
+#include <type_traits>
 #include <ggml.h>
 #include <llama.h>
 #include <common/grammar-parser.h>
+#include "justlm_prefill.hpp"
+#include "justlm_threads.hpp"
+#include "justlm_compute.hpp"
 
 
 namespace LM {
@@ -11,12 +16,14 @@ class LLaMAInference final : public Inference {
     struct State {
         llama_context *ctx = nullptr;
         llama_model *model;
+        std::string weights_path;
         llama_grammar *grammar = nullptr;
         bool grammar_override_temp;
         grammar_parser::parse_state parsed_grammar;
         std::string prompt; // Mostly here for easy "debugging"
         std::vector<int> tokens;
         unsigned n_ctx;
+        unsigned n_batch_max;
     };
 
     State*& get_state() {
@@ -26,26 +33,59 @@ class LLaMAInference final : public Inference {
         return *reinterpret_cast<State* const*>(&generic_state);
     }
 
-    LM_ERRBOOL init(const std::string& weights_path) LM_NOEXCEPTDECL {
+    // Forwards the loading progress of llama.cpp, which is reported from 0 to 1
+    struct LoadProgress {
+        const AppendCallback& on_progress;
+        bool cancelled = false;
+
+        // Reports progress in percent and returns false once cancelled
+        bool report(float progress) {
+            if (!cancelled && on_progress) cancelled = !on_progress(progress);
+            return !cancelled;
+        }
+
+        // Returns what this llama.cpp expects of its progress callback; older ones can't cancel, so loading only stops afterwards
+        static auto callback(float progress, void *ctx) -> std::invoke_result_t<llama_progress_callback, float, void *> {
+            auto& self = *static_cast<LoadProgress *>(ctx);
+            return static_cast<std::invoke_result_t<llama_progress_callback, float, void *>>(self.report(progress*100.f));
+        }
+    };
+
+    LM_ERRBOOL init(const std::string& weights_path, const AppendCallback& on_progress) LM_NOEXCEPTDECL {
         auto& state = get_state();
 
+        // Allocate everything on the requested NUMA node
+        NumaBinding numa_binding(params.numa_node);
+
         // Allocate state
         state = new State;
+        state->weights_path = weights_path;
 
         // Get llama parameters
         auto lparams = llama_context_default_params();
         lparams.seed = params.seed;
         lparams.n_ctx = params.n_ctx = params.n_ctx>0?params.n_ctx:2024;
         lparams.n_threads = params.n_threads;
-        //lparams.n_threads_batch = params.n_threads;  TODO: Is this sane?
+        lparams.n_threads_batch = params.n_threads_batch;
+        lparams.n_batch = std::max<uint32_t>(lparams.n_batch, params.n_batch); // Largest batch llama_decode takes; prompt evaluation never goes below n_batch
+        lparams.f16_kv = params.kv_type != KVType::F32; // No quantized KV cache in this llama.cpp
 
         // Get model parameters
         auto mparams = llama_model_default_params();
         mparams.use_mlock = params.use_mlock;
         mparams.n_gpu_layers = params.n_gpu_layers;
+        LoadProgress progress{on_progress};
+        mparams.progress_callback = LoadProgress::callback;
+        mparams.progress_callback_user_data = &progress;
 
         // Load model
         state->model = llama_load_model_from_file(weights_path.c_str(), mparams);
+        if (progress.cancelled) {
+            if (state->model) llama_free_model(state->model);
+            delete state;
+            state = nullptr;
+            LM_THROW("Loading llama model was cancelled", LM_BOOL_ERROR);
+        }
         if (!state->model) {
             LM_THROW("Failed to initialize llama model from file", LM_BOOL_ERROR);
         }
@@ -59,9 +99,69 @@ class LLaMAInference final : public Inference {
         // Initialize some variables
         state->n_ctx = llama_n_ctx(state->ctx);
 
+        // Optionally calibrate thread counts for generation and prompt evaluation
+        // Progress is reported again before each measurement, so construction can still be cancelled after loading
+        std::vector<int> dummy_tokens(lparams.n_batch, llama_token_eos(state->model));
+        if (params.n_threads_autotune) {
+            const auto& topology = Topology::get();
+            const auto node = topology.get_node(params.numa_node);
+            const unsigned max_threads = std::min<unsigned>(node?node->cpus.size():topology.cpus.size(), topology.get_usable_thread_count());
+            // Measured under a lease like any evaluation, so other instances neither skew the measurements nor get starved
+            const auto lease = ComputePool::get().acquire(max_threads, params.numa_node);
+            params.n_threads = calibrate_threads(lease.get_thread_count(), [&] (unsigned n_threads) {
+                if (!progress.report(100.f)) return false;
+                llama_set_n_threads(state->ctx, n_threads, n_threads);
+                const bool fres = !llama_decode(state->ctx, llama_batch_get_one(dummy_tokens.data(), 1, 0, 0));
+                llama_kv_cache_seq_rm(state->ctx, 0, -1, -1);
+                return fres;
+            });
+            params.n_threads_batch = calibrate_threads(lease.get_thread_count(), [&] (unsigned n_threads) {
+                if (!progress.report(100.f)) return false;
+                llama_set_n_threads(state->ctx, n_threads, n_threads);
+                const bool fres = !llama_decode(state->ctx, llama_batch_get_one(dummy_tokens.data(), params.n_batch, 0, 0));
+                llama_kv_cache_seq_rm(state->ctx, 0, -1, -1);
+                return fres;
+            });
+            llama_set_n_threads(state->ctx, params.n_threads, params.n_threads_batch);
+        }
+
+        // Get prefill scheduler and optionally tune batch size
+        state->n_batch_max = lparams.n_batch;
+        if (params.n_batch_autotune) {
+            const auto lease = ComputePool::get().acquire(params.n_threads_batch, params.numa_node);
+            llama_set_n_threads(state->ctx, lease.get_thread_count(), lease.get_thread_count());
+            params.n_batch = get_prefill_scheduler().autotune([&] (unsigned n_tokens) {
+                if (!progress.report(100.f)) return false;
+                const bool fres = !llama_decode(state->ctx, llama_batch_get_one(dummy_tokens.data(), n_tokens, 0, 0));
+                llama_kv_cache_seq_rm(state->ctx, 0, -1, -1);
+                return fres;
+            });
+        }
+
+        // The measurements stop early once cancelled
+        if (progress.cancelled) {
+            llama_free(state->ctx);
+            llama_free_model(state->model);
+            delete state;
+            state = nullptr;
+            LM_THROW("Loading llama model was cancelled", LM_BOOL_ERROR);
+        }
+
         return LM_BOOL_SUCCESS;
     }
 
+    PrefillScheduler& get_prefill_scheduler() {
+        return PrefillScheduler::get("llama", get_state()->weights_path, params.n_threads_batch, params.n_batch, get_state()->n_batch_max);
+    }
+
+    // Evaluates given batch using threads leased from the shared compute pool
+    bool decode(const llama_batch& batch) {
+        auto& state = get_state();
+        const auto lease = ComputePool::get().acquire(batch.n_tokens==1?params.n_threads:params.n_threads_batch, params.numa_node);
+        llama_set_n_threads(state->ctx, lease.get_thread_count(), lease.get_thread_count());
+        return !llama_decode(state->ctx, batch);
+    }
+
     // This function reduces the size of our tokens vector according to some parameters
     // All tokens will be evaluated if scrolling was needed and true will be returned
     bool window_scroll() LM_NOEXCEPTDECL {
@@ -93,19 +193,24 @@ class LLaMAInference final : public Inference {
     LM_ERRBOOL evaluate_tokens(size_t starting_offset, const AppendCallback &on_tick = nullptr) LM_NOEXCEPTDECL {
         auto& state = get_state();
 
-        // Evaluate tokens in batches
-        unsigned it;
-        for (it = starting_offset; ; it += params.n_batch) {
-            if (it + params.n_batch >= ssize_t(state->tokens.size())) break;
+        // Evaluate tokens in batches sized by the prefill scheduler
+        auto& prefill = get_prefill_scheduler();
+        size_t it = starting_offset;
+        while (it != state->tokens.size()) {
+            // Get batch size; the remainder is evaluated as a single batch
+            const unsigned n_batch = prefill.next_chunk(state->tokens.size()-it);
 
             // Evaluate
-            const auto batch = llama_batch_get_one(state->tokens.data()+it, params.n_batch, it, 0);
-            if (llama_decode(state->ctx, batch)) {
+            const auto batch = llama_batch_get_one(state->tokens.data()+it, n_batch, it, 0);
+            const auto t_start = std::chrono::steady_clock::now();
+            if (!decode(batch)) {
                 LM_THROW("Failed to evaluate tokens in batches", LM_BOOL_ERROR);
             }
+            prefill.record(n_batch, std::chrono::steady_clock::now()-t_start);
+            it += n_batch;
 
             // Tick
-            if (on_tick) {
+            if (on_tick && it != state->tokens.size()) {
                 // Calculate progress
                 auto progress = float(it-starting_offset) / (state->tokens.size()-starting_offset) * 100.f;
                 // Tick and yield
@@ -113,16 +218,6 @@ class LLaMAInference final : public Inference {
             }
         }
 
-        // Evaluate remaining tokens
-        if (it < state->tokens.size()) {
-            for (; it != state->tokens.size(); it++) {
-                const auto batch = llama_batch_get_one(state->tokens.data()+it, 1, it, 0);
-                if (llama_decode(state->ctx, batch)) {
-                    LM_THROW("Failed to evaluate individual tokens", LM_BOOL_ERROR);
-                }
-            }
-        }
-
         // Notify about completion
         if (on_tick) on_tick(100.f);
 
@@ -185,8 +280,8 @@ class LLaMAInference final : public Inference {
     }
 
 public:
-    LLaMAInference(const std::string& weights_path, const Params& p) : Inference(p) {
-        init(weights_path);
+    LLaMAInference(const std::string& weights_path, const Params& p, const AppendCallback& on_progress) : Inference(p) {
+        init(weights_path, on_progress);
     }
     ~LLaMAInference() override {
         auto& state = get_state();
@@ -210,8 +305,9 @@ public:
         const auto old_token_count = state->tokens.size();
         state->tokens.resize(old_token_count+state->prompt.size());
 
-        // Run tokenizer
-        const auto token_count = llama_tokenize(state->model, prompt.c_str(), prompt.size(), state->tokens.data()+old_token_count, state->tokens.size()-old_token_count, was_empty, false);
+        // Run tokenizer; only SentencePiece vocabularies (LLaMA and alike) expect a BOS token, GPT-J and MPT don't
+        const bool add_bos = was_empty && llama_vocab_type(state->model) == LLAMA_VOCAB_TYPE_SPM;
+        const auto token_count = llama_tokenize(state->model, prompt.c_str(), prompt.size(), state->tokens.data()+old_token_count, state->tokens.size()-old_token_count, add_bos, false);
         state->tokens.resize(old_token_count+token_count);
 
         // Make sure token limit isn't being hit
@@ -272,7 +368,7 @@ public:
                 // Evaluate token
                 //  TODO: Respect batch size
                 const auto batch = llama_batch_get_one(state->tokens.data()+state->tokens.size()-1, 1, state->tokens.size()-1, 0);
-                if (llama_decode(state->ctx, batch)) {
+                if (!decode(batch)) {
                     LM_THROW("Failed to evaluate new tokens", "");
                 }
             }
@@ -0,0 +1,112 @@
+#ifndef JUSTLM_PREFILL_HPP
+#define JUSTLM_PREFILL_HPP
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+
+namespace LM {
+// Picks prompt evaluation batch sizes based on measured throughput
+// One scheduler is shared per model, thread count and batch size range
+class PrefillScheduler {
+    struct Sample {
+        double tokens_per_second = 0.0;
+        unsigned count = 0;
+    };
+
+    mutable std::mutex mutex;
+    std::map<unsigned, Sample> samples; // Candidate batch size -> measured throughput
+    unsigned n_batch_min;
+    unsigned n_batch_max;
+
+    // Returns best measured batch size; n_batch_min if nothing was measured yet
+    unsigned get_best() const {
+        unsigned fres = n_batch_min;
+        double best_tps = 0.0;
+        for (const auto& [n_batch, sample] : samples) {
+            if (sample.count && sample.tokens_per_second > best_tps) {
+                fres = n_batch;
+                best_tps = sample.tokens_per_second;
+            }
+        }
+        return fres;
+    }
+
+public:
+    PrefillScheduler(unsigned n_batch_min, unsigned n_batch_max)
+            : n_batch_min(std::max(n_batch_min, 1u)), n_batch_max(std::max(n_batch_max, this->n_batch_min)) {
+        // Candidates are n_batch_min doubled until n_batch_max is reached
+        for (unsigned n_batch = this->n_batch_min; n_batch < this->n_batch_max; n_batch *= 2) {
+            samples[n_batch];
+        }
+        samples[this->n_batch_max];
+    }
+    PrefillScheduler(const PrefillScheduler&) = delete;
+
+    // Returns scheduler shared by all instances of given backend evaluating the model at weights_path with given thread
+    // count and batch sizes; throughput depends on the model, so different ones never share measurements
+    static PrefillScheduler& get(const std::string& backend, const std::string& weights_path, unsigned n_threads, unsigned n_batch_min, unsigned n_batch_max) {
+        static std::mutex registry_mutex;
+        static std::map<std::tuple<std::string, std::string, unsigned, unsigned, unsigned>, PrefillScheduler> registry;
+        std::scoped_lock L(registry_mutex);
+        return registry.try_emplace({backend, weights_path, n_threads, n_batch_min, n_batch_max}, n_batch_min, n_batch_max).first->second;
+    }
+
+    // Returns the amount of tokens to evaluate next out of given remaining token count
+    unsigned next_chunk(size_t remaining) const {
+        // Evaluate remainder as a single batch if possible
+        if (remaining <= n_batch_max) return remaining;
+        std::scoped_lock L(mutex);
+        // Explore next larger candidate as long as throughput keeps improving
+        const auto best = get_best();
+        auto next = samples.upper_bound(best);
+        if (next != samples.end() && next->second.count == 0) {
+            return next->first;
+        }
+        return best;
+    }
+
+    // Records the time it took to evaluate given amount of tokens
+    void record(unsigned n_tokens, std::chrono::steady_clock::duration duration) {
+        const auto seconds = std::chrono::duration<double>(duration).count();
+        if (seconds <= 0.0) return;
+        std::scoped_lock L(mutex);
+        // Only candidate batch sizes are tracked
+        auto res = samples.find(n_tokens);
+        if (res == samples.end()) return;
+        auto& sample = res->second;
+        // Update moving average
+        const double tps = n_tokens / seconds;
+        if (sample.count++ == 0) {
+            sample.tokens_per_second = tps;
+        } else {
+            sample.tokens_per_second = sample.tokens_per_second*0.75 + tps*0.25;
+        }
+    }
+
+    // Measures all candidates once using given evaluation function and returns best batch size
+    // The function gets the amount of tokens to evaluate passed and must return false on error
+    template<typename EvalFnc>
+    unsigned autotune(const EvalFnc& eval) {
+        std::vector<unsigned> candidates;
+        {
+            std::scoped_lock L(mutex);
+            for (const auto& [n_batch, sample] : samples) {
+                candidates.push_back(n_batch);
+            }
+        }
+        for (const auto n_batch : candidates) {
+            const auto t_start = std::chrono::steady_clock::now();
+            if (!eval(n_batch)) break;
+            record(n_batch, std::chrono::steady_clock::now() - t_start);
+        }
+        std::scoped_lock L(mutex);
+        return get_best();
+    }
+};
+}
+#endif // JUSTLM_PREFILL_HPP
@@ -0,0 +1,36 @@
+#ifndef JUSTLM_THREADS_HPP
+#define JUSTLM_THREADS_HPP
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+
+namespace LM {
+// Returns the thread count out of max_threads and its halvings (down to an eighth) with which eval runs fastest
+// The function gets the thread count to use passed and must return false on error
+template<typename EvalFnc>
+unsigned calibrate_threads(unsigned max_threads, const EvalFnc& eval, unsigned repeats = 2) {
+    // Collect candidates
+    std::vector<unsigned> candidates;
+    for (unsigned n_threads = max_threads; n_threads >= std::max(max_threads/8, 1u); n_threads /= 2) {
+        candidates.push_back(n_threads);
+        if (n_threads == 1) break;
+    }
+    // Find fastest one
+    unsigned fres = max_threads;
+    auto best_duration = std::chrono::steady_clock::duration::max();
+    for (const auto n_threads : candidates) {
+        for (unsigned it = 0; it != repeats; it++) {
+            const auto t_start = std::chrono::steady_clock::now();
+            if (!eval(n_threads)) return fres;
+            const auto duration = std::chrono::steady_clock::now() - t_start;
+            if (duration < best_duration) {
+                fres = n_threads;
+                best_duration = duration;
+            }
+        }
+    }
+    return fres;
+}
+}
+#endif // JUSTLM_THREADS_HPP
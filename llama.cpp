@@ -4,10 +4,80 @@
 #include <string>
 #include <string_view>
 #include <fstream>
+#include <functional>
+#include <iterator>
+#include <algorithm>
 #include <cstdint>
 
 
 
+// Reads the general.architecture value from the header of a GGUF file; returns an empty string if there is none
+static std::string gguf_get_architecture(std::istream& f) {
+    // Check magic and version
+    uint32_t magic = 0, version = 0;
+    f.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    f.read(reinterpret_cast<char*>(&version), sizeof(version));
+    if (!f || magic != 0x46554747 || version == 0) return "";
+    // Version 1 uses 32 bit counts and lengths, later versions 64 bit ones
+    const auto read_count = [&] () -> uint64_t {
+        if (version == 1) {
+            uint32_t v = 0;
+            f.read(reinterpret_cast<char*>(&v), sizeof(v));
+            return v;
+        }
+        uint64_t v = 0;
+        f.read(reinterpret_cast<char*>(&v), sizeof(v));
+        return v;
+    };
+    const auto read_string = [&] (std::string& str) {
+        const auto len = read_count();
+        if (!f || len > 0x10000) return false;
+        str.resize(len);
+        return bool(f.read(str.data(), len));
+    };
+    // Skips value of given type
+    const std::function<bool (uint32_t)> skip_value = [&] (uint32_t type) -> bool {
+        constexpr uint32_t gguf_string = 8, gguf_array = 9;
+        constexpr size_t type_sizes[] = {1, 1, 2, 2, 4, 4, 4, 1, 0, 0, 8, 8, 8};
+        if (type == gguf_string) {
+            std::string str;
+            return read_string(str);
+        }
+        if (type == gguf_array) {
+            uint32_t element_type = 0;
+            f.read(reinterpret_cast<char*>(&element_type), sizeof(element_type));
+            const auto count = read_count();
+            if (!f || element_type >= std::size(type_sizes)) return false;
+            if (element_type == gguf_string || element_type == gguf_array) {
+                for (uint64_t it = 0; it != count; it++) {
+                    if (!skip_value(element_type)) return false;
+                }
+                return true;
+            }
+            return bool(f.seekg(count*type_sizes[element_type], std::ios::cur));
+        }
+        if (type >= std::size(type_sizes)) return false;
+        return bool(f.seekg(type_sizes[type], std::ios::cur));
+    };
+    // Find architecture among key/value pairs
+    read_count(); // Tensor count
+    const auto n_kv = read_count();
+    for (uint64_t it = 0; f && it != n_kv; it++) {
+        std::string key;
+        uint32_t type = 0;
+        if (!read_string(key)) break;
+        f.read(reinterpret_cast<char*>(&type), sizeof(type));
+        if (key == "general.architecture" && type == 8) {
+            std::string fres;
+            if (read_string(fres)) return fres;
+            break;
+        }
+        if (!skip_value(type)) break;
+    }
+    return "";
+}
+
+
 extern "C" {
 const LM::Implementation *get_justlm_implementation() {
     static LM::Implementation fres{false};
@@ -15,22 +85,24 @@ const LM::Implementation *get_justlm_implementation() {
 }
 
 bool magic_match(std::istream& f) {
-    // Check magic
-    uint32_t magic = 0;
-    f.read(reinterpret_cast<char*>(&magic), sizeof(magic));
-    return magic == 0x46554747;
+    // GGUF files are served here if the pinned llama.cpp can build their graph, which includes MPT conversions
+    // It knows GPT-J, GPT-2 and GPT-NeoX by name only and fails to load them, so those are left to other backends
+    static const std::string_view supported[] = {"llama", "falcon", "baichuan", "starcoder", "persimmon", "refact", "bloom", "mpt"};
+    const auto arch = gguf_get_architecture(f);
+    return std::find(std::begin(supported), std::end(supported), arch) != std::end(supported);
 }
 
-LM::Inference *construct(const std::string &weights_path, std::ifstream& f, const LM::Inference::Params &p) {
+LM::Inference *construct(const std::string &weights_path, std::ifstream& f, const LM::Inference::Params &p, const LM::AppendCallback &on_progress) {
     f.close();
-    return new LM::LLaMAInference(weights_path, p);
+    return new LM::LLaMAInference(weights_path, p, on_progress);
 }
 }
 
 
 __attribute__((constructor))
 static void init() {
-    llama_backend_init(true);
+    // ggml's own NUMA mode would re-pin the shared compute pools workers; see Params::numa_node instead
+    llama_backend_init(false);
 }
 
 __attribute__((destructor))
@@ -1,5 +1,7 @@
 #include "mpt.hpp"
 #include "../g4a_common.hpp"
+#include "../g4a_ops.hpp"
+#include "justlm_compute.hpp"
 
 #include <cassert>
 #include <cmath>
@@ -14,6 +16,8 @@
 #include "../msvc_compat_unistd.h"
 #include <sstream>
 #include <thread>
+#include <memory>
+#include <algorithm>
 #include <unordered_set>
 #include <regex>
 #include <ggml.h>
@@ -23,6 +27,7 @@ unsigned long long operator ""_MiB(unsigned long long bytes) {
     return bytes*1024*1024;
 }
 
+// allocates room for n_ctx tokens per layer
 static bool kv_cache_init(
         const struct mpt_hparams & hparams,
              struct mpt_kv_cache & cache,
@@ -34,7 +39,7 @@ static bool kv_cache_init(
     const int64_t n_mem      = (int64_t)n_layer*n_ctx;
     const int64_t n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2_MiB);
+    cache.buf.resize(2u*g4a_row_size(wtype, n_elements) + 2_MiB);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -51,11 +56,62 @@ static bool kv_cache_init(
     cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
     cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
 
+    cache.n_ctx = n_ctx;
+
     return true;
 }
 
+// reallocates a cache of model with room for n_ctx tokens per layer, keeping its contents
+static bool kv_cache_resize(mpt_model & model, mpt_kv_cache & cache, int n_ctx) {
+    // the current allocation is kept until its contents are copied
+    mpt_kv_cache old;
+    std::swap(old.ctx, cache.ctx);
+    std::swap(old.buf.addr, cache.buf.addr);
+    std::swap(old.buf.size, cache.buf.size);
+    old.k = cache.k;
+    old.v = cache.v;
+    old.n_ctx = cache.n_ctx;
+
+    if (!kv_cache_init(model.hparams, cache, old.k->type, n_ctx)) {
+        return false;
+    }
+
+    const int n_embd  = model.hparams.n_embd;
+    const int n_layer = model.hparams.n_layer;
+
+    const int n_cpy = std::min(old.n_ctx, n_ctx);
+
+    // keys and values are both stored by position
+    for (int il = 0; il < n_layer; il++) {
+        for (auto kv : {std::make_pair(cache.k, old.k), std::make_pair(cache.v, old.v)}) {
+            memcpy((char *) kv.first->data  + g4a_row_size(kv.first->type, size_t(il)*n_ctx*n_embd),
+                   (char *) kv.second->data + g4a_row_size(kv.first->type, size_t(il)*old.n_ctx*n_embd), g4a_row_size(kv.first->type, size_t(n_cpy)*n_embd));
+        }
+    }
+
+    // the cached decode graph refers to the old allocation of the model's own cache
+    if (&cache == &model.kv_self) {
+        model.decode_graph.reset();
+    }
+
+    return true;
+}
+
+// makes room for n_tokens tokens per layer if the cache is growable
+static bool kv_cache_reserve(mpt_model & model, mpt_kv_cache & cache, int n_tokens) {
+    if (n_tokens <= cache.n_ctx || cache.n_ctx >= cache.n_ctx_max) {
+        return true;
+    }
+
+    const int n_ctx = std::min((n_tokens + cache.n_chunk - 1)/cache.n_chunk*cache.n_chunk, cache.n_ctx_max);
+    return kv_cache_resize(model, cache, n_ctx);
+}
+
 // load the model's weights from a stream
-bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab & vocab) {
+// the KV cache gets room for n_ctx tokens, or the context size of the model if 0; with n_ctx_chunk set it is allocated
+// in chunks of that many tokens as the context fills instead. Its values are stored as kv_type: F32, F16 or Q8_0
+// fin must read fname from its beginning; the weights are read from fname by several threads while progress is reported
+bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab & vocab, int n_ctx, int n_ctx_chunk, ggml_type kv_type, const g4a_mmap_params & mmap_params, const g4a_load_progress & progress) {
     printf("%s: loading model from '%s' - please wait ...\n", __func__, fname.c_str());
 
     // verify magic
@@ -127,21 +183,46 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
 
     // for the big tensors, we have the option to store the data in 16-bit floats or quantized
     // in order to save memory and also to speed up the computation
-    ggml_type wtype = GGML_TYPE_COUNT;
-    switch (model.hparams.f16) {
-        case 0: wtype = GGML_TYPE_F32;  break;
-        case 1: wtype = GGML_TYPE_F16;  break;
-        case 2: wtype = GGML_TYPE_Q4_0; break;
-        case 3: wtype = GGML_TYPE_Q4_1; break;
-        case 5: wtype = GGML_TYPE_Q4_2; break;
-        default:
-                {
-                    fprintf(stderr, "%s: invalid model file '%s' (bad f16 value %d)\n",
-                            __func__, fname.c_str(), model.hparams.f16);
-                    return false;
-                }
+    const ggml_type wtype = g4a_ftype_to_type(model.hparams.f16);
+    if (wtype == GGML_TYPE_COUNT) {
+        fprintf(stderr, "%s: invalid model file '%s' (bad f16 value %d)\n",
+                __func__, fname.c_str(), model.hparams.f16);
+        return false;
     }
 
+    // weights may be stored in other types than the model wide one
+    std::map<std::string, g4a_tensor_info> tensor_infos;
+    if (!g4a_read_tensor_infos(fin, tensor_infos)) {
+        fprintf(stderr, "%s: invalid model file '%s' (bad tensor header)\n", __func__, fname.c_str());
+        return false;
+    }
+    const auto tensor_type = [&] (const std::string & name) {
+        const auto res = tensor_infos.find(name);
+        return res == tensor_infos.end() ? wtype : res->second.type;
+    };
+
+    // the matrices can point straight into the mapped file if their offset suits their type
+    if (mmap_params.use_mmap) {
+        model.mapping = std::make_unique<g4a_mmap>();
+        if (!model.mapping->map(fname, mmap_params.populate)) {
+            fprintf(stderr, "%s: failed to map '%s', reading it instead\n", __func__, fname.c_str());
+            model.mapping.reset();
+        }
+    }
+    std::unordered_set<std::string> direct_weights = {"transformer.wte.weight"};
+    for (int i = 0; i < model.hparams.n_layer; ++i) {
+        const std::string prefix = "transformer.blocks." + std::to_string(i) + ".";
+        direct_weights.insert({prefix + "attn.Wqkv.weight", prefix + "attn.out_proj.weight", prefix + "ffn.up_proj.weight", prefix + "ffn.down_proj.weight"});
+    }
+    const auto mapped_info = [&] (const std::string & name) -> const g4a_tensor_info * {
+        const auto res = tensor_infos.find(name);
+        if (!model.mapping || res == tensor_infos.end() || !direct_weights.count(name) ||
+            !g4a_mmap_offset_valid(res->second.type, res->second.offset) || res->second.offset + res->second.nbytes > model.mapping->size()) {
+            return nullptr;
+        }
+        return &res->second;
+    };
+
     auto & ctx = model.ctx;
 
     size_t ctx_size = 0;
@@ -151,14 +232,13 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
 
         const int n_embd  = hparams.n_embd;
         const int n_layer = hparams.n_layer;
-        const int n_ctx   = hparams.n_ctx;
         const int n_vocab = hparams.n_vocab;
         const int expand  = hparams.expand;
 
 
         ctx_size += n_embd*ggml_type_sizef(GGML_TYPE_F32); // ln_f_w
 
-        ctx_size += n_embd*n_vocab*ggml_type_sizef(GGML_TYPE_F32); // wte
+        ctx_size += n_embd*n_vocab*ggml_type_sizef(tensor_type("transformer.wte.weight")); // wte
 
         ctx_size += n_layer*(n_embd*ggml_type_sizef(GGML_TYPE_F32)); // norm_1_w
         ctx_size += n_layer*(n_embd*ggml_type_sizef(GGML_TYPE_F32)); // norm_2_w
@@ -169,20 +249,33 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         ctx_size += n_layer*(expand*n_embd*n_embd*ggml_type_sizef(wtype));  // ffn_up_proj_w
         ctx_size += n_layer*(expand*n_embd*n_embd*ggml_type_sizef(wtype)); // ffn_down_proj_w
 
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F16); // memory_k
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F16); // memory_v
-
         // TODO probably less now?
         ctx_size += (5 + 10*n_layer)*256; // object overhead
 
+        // weights stored at a higher precision than the model wide type need more
+        size_t file_size = (5 + 10*n_layer)*256;
+        for (const auto & info : tensor_infos) {
+            file_size += info.second.nbytes;
+        }
+        ctx_size = std::max(ctx_size, file_size);
+
+        // mapped weights take no memory of their own
+        for (const auto & info : tensor_infos) {
+            if (mapped_info(info.first)) {
+                ctx_size -= info.second.nbytes;
+            }
+        }
+
         printf("%s: ggml ctx size = %6.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
 
     // create the ggml context
     {
+        model.weights_buf.resize(ctx_size);
+
         struct ggml_init_params params = {
-            .mem_size   = ctx_size,
-            .mem_buffer = NULL,
+            .mem_size   = model.weights_buf.size,
+            .mem_buffer = model.weights_buf.addr,
             .no_alloc   = false,
         };
 
@@ -193,6 +286,31 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         }
     }
 
+    // and the one of the mapped weights, which only holds their headers
+    if (model.mapping) {
+        struct ggml_init_params params = {
+            .mem_size   = size_t(5 + 10*model.hparams.n_layer)*256,
+            .mem_buffer = NULL,
+            .no_alloc   = true,
+        };
+
+        model.ctx_mapped = ggml_init(params);
+        if (!model.ctx_mapped) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            return false;
+        }
+    }
+
+    // creates a weight of given name, pointing into the mapped file if possible
+    const auto new_weight = [&] (const std::string & name, int64_t ne0, int64_t ne1) {
+        if (const auto info = mapped_info(name)) {
+            struct ggml_tensor * tensor = ggml_new_tensor_2d(model.ctx_mapped, info->type, ne0, ne1);
+            tensor->data = (void *) (model.mapping->addr() + info->offset);
+            return tensor;
+        }
+        return ggml_new_tensor_2d(ctx, tensor_type(name), ne0, ne1);
+    };
+
     // prepare memory for the weights
     {
         const auto & hparams = model.hparams;
@@ -204,7 +322,8 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
 
         model.layers.resize(n_layer);
 
-        model.wte    = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_vocab);
+        // wte doubles as the output head, so it may be F16 or quantized like the other weights
+        model.wte    = new_weight("transformer.wte.weight", n_embd, n_vocab);
         model.norm_f_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
 
         // map by name
@@ -214,22 +333,24 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         for (int i = 0; i < n_layer; ++i) {
             auto & layer = model.layers[i];
 
+            const std::string prefix = "transformer.blocks." + std::to_string(i) + ".";
+
             layer.norm_1_w        = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
             layer.norm_2_w        = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
 
-            layer.attn_Wqkv_w     = ggml_new_tensor_2d(ctx, wtype,        n_embd, n_embd * 3);
-            layer.attn_out_proj_w = ggml_new_tensor_2d(ctx, wtype,        n_embd, n_embd);
-            layer.ffn_up_proj_w   = ggml_new_tensor_2d(ctx, wtype,        n_embd, expand*n_embd);
-            layer.ffn_down_proj_w = ggml_new_tensor_2d(ctx, wtype, expand*n_embd, n_embd);
+            layer.attn_Wqkv_w     = new_weight(prefix + "attn.Wqkv.weight",            n_embd, n_embd * 3);
+            layer.attn_out_proj_w = new_weight(prefix + "attn.out_proj.weight",        n_embd, n_embd);
+            layer.ffn_up_proj_w   = new_weight(prefix + "ffn.up_proj.weight",          n_embd, expand*n_embd);
+            layer.ffn_down_proj_w = new_weight(prefix + "ffn.down_proj.weight", expand*n_embd, n_embd);
 
             // map by name
-            model.tensors["transformer.blocks." + std::to_string(i) + ".norm_1.weight"]        = layer.norm_1_w;
-            model.tensors["transformer.blocks." + std::to_string(i) + ".norm_2.weight"]        = layer.norm_2_w;
-            model.tensors["transformer.blocks." + std::to_string(i) + ".attn.Wqkv.weight"]     = layer.attn_Wqkv_w;
-            model.tensors["transformer.blocks." + std::to_string(i) + ".attn.out_proj.weight"] = layer.attn_out_proj_w;
+            model.tensors[prefix + "norm_1.weight"]        = layer.norm_1_w;
+            model.tensors[prefix + "norm_2.weight"]        = layer.norm_2_w;
+            model.tensors[prefix + "attn.Wqkv.weight"]     = layer.attn_Wqkv_w;
+            model.tensors[prefix + "attn.out_proj.weight"] = layer.attn_out_proj_w;
 
-            model.tensors["transformer.blocks." + std::to_string(i) + ".ffn.up_proj.weight"]   = layer.ffn_up_proj_w;
-            model.tensors["transformer.blocks." + std::to_string(i) + ".ffn.down_proj.weight"] = layer.ffn_down_proj_w;
+            model.tensors[prefix + "ffn.up_proj.weight"]   = layer.ffn_up_proj_w;
+            model.tensors[prefix + "ffn.down_proj.weight"] = layer.ffn_down_proj_w;
         }
     }
 
@@ -237,7 +358,16 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
     {
         const auto & hparams = model.hparams;
 
-        if (!kv_cache_init(hparams, model.kv_self, GGML_TYPE_F16, model.hparams.n_ctx)) {
+        auto & kv_self = model.kv_self;
+        kv_self.n_ctx_max = n_ctx > 0 ? n_ctx : hparams.n_ctx;
+        kv_self.n_chunk   = std::max(0, n_ctx_chunk);
+
+        // attention reads quantized keys and values per head, so a head must be whole blocks
+        if ((hparams.n_embd/hparams.n_head) % ggml_blck_size(kv_type) != 0) {
+            kv_type = GGML_TYPE_F16;
+        }
+
+        if (!kv_cache_init(hparams, kv_self, kv_type, kv_self.n_chunk ? std::min(kv_self.n_chunk, kv_self.n_ctx_max) : kv_self.n_ctx_max)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             ggml_free(ctx);
             return false;
@@ -248,11 +378,12 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
     }
 
     // load weights
+    // the headers are checked first, then the data of all tensors that aren't mapped is read in parallel
+    size_t mapped_size = 0;
     {
         int n_tensors = 0;
         size_t total_size = 0;
-
-        printf("%s: ", __func__);
+        std::vector<g4a_read_job> jobs;
 
         while (true) {
             int32_t n_dims;
@@ -299,6 +430,11 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
                 printf("%24s - [%5d, %5d], type = %6s, %6.2f MB, %9zu bytes\n", name.data(), ne[0], ne[1], ggml_type_name(ggml_type(ttype)), ggml_nbytes(tensor)/1024.0/1024.0, ggml_nbytes(tensor));
             }
 
+            if (!g4a_tensor_type_valid(ttype, ne[0]) || ggml_type(ttype) != tensor->type) {
+                fprintf(stderr, "%s: tensor '%s' has unsupported or unexpected type %d in model file\n", __func__, name.data(), ttype);
+                return false;
+            }
+
             const size_t bpe = ggml_type_size(ggml_type(ttype));
 
             if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
@@ -307,26 +443,73 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            if (model.mapping && model.mapping->contains(tensor->data)) {
+                fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+                mapped_size += ggml_nbytes(tensor);
+            } else {
+                jobs.push_back({size_t(fin.tellg()), ggml_nbytes(tensor), tensor->data});
+                fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+            }
 
             //printf("%42s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ttype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
-            if (++n_tensors % 8 == 0) {
-                printf(".");
-                fflush(stdout);
-            }
+            n_tensors++;
         }
 
-        printf(" done\n");
+        // more streams than that don't add throughput on common storage
+        const int n_threads = std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+        if (!g4a_read_tensors(fname, jobs, n_threads, progress)) {
+            return false;
+        }
 
         printf("%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
+        if (model.mapping) {
+            printf("%s: mapped size = %8.2f MB\n", __func__, mapped_size/1024.0/1024.0);
+        }
+    }
+
+    // the mapping isn't needed if the offsets of all weights were unsuitable
+    if (model.mapping && !mapped_size) {
+        model.mapping.reset();
+    }
+
+    if (mmap_params.mlock) {
+        g4a_mlock(model.weights_buf.addr, model.weights_buf.size);
+        if (model.mapping) {
+            g4a_mlock(model.mapping->addr(), model.mapping->size());
+        }
+    }
+
+    // interleave the rows of quantized weights for the AVX-512 VNNI kernels where supported
+    // mapped weights are read-only and shared, so they are kept as stored along with all others
+    // progress is reported again before each, so loading can still be cancelled meanwhile
+    if (!model.mapping) {
+        const int n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        int n_repacked = 0;
+        for (auto & layer : model.layers) {
+            for (auto w : {layer.attn_Wqkv_w, layer.attn_out_proj_w, layer.ffn_up_proj_w, layer.ffn_down_proj_w}) {
+                if (g4a_repack_supported(w)) {
+                    if (progress && !progress(100.f)) {
+                        return false;
+                    }
+                    g4a_repack(w, n_threads);
+                    n_repacked++;
+                }
+            }
+        }
+        model.repacked = true;
+
+        if (n_repacked) {
+            printf("%s: repacked %d tensors\n", __func__, n_repacked);
+        }
     }
 
     return true;
 }
 
 // load the model's weights from a file path
-bool mpt_model_load(const std::string & fname, mpt_model & model, gpt_vocab & vocab) {
+bool mpt_model_load(const std::string & fname, mpt_model & model, gpt_vocab & vocab, int n_ctx, int n_ctx_chunk, ggml_type kv_type, const g4a_mmap_params & mmap_params, const g4a_load_progress & progress) {
 
     auto fin = std::ifstream(fname, std::ios::binary);
     if (!fin) {
@@ -334,58 +517,179 @@ bool mpt_model_load(const std::string & fname, mpt_model & model, gpt_vocab & vo
         return false;
     }
 
-    bool loaded = mpt_model_load(fname, fin, model, vocab);
+    bool loaded = mpt_model_load(fname, fin, model, vocab, n_ctx, n_ctx_chunk, kv_type, mmap_params, progress);
     fin.close();
     return loaded;
 }
 
-bool mpt_eval(
-        mpt_model & model,
+// Converts n consecutive values of a KV cache to F32; offset and n must be whole blocks if it's quantized
+static void kv_to_f32(const struct ggml_tensor * kv, size_t offset, size_t n, float * dst) {
+    g4a_convert_row(kv->type, (const char *) kv->data + g4a_row_size(kv->type, offset), GGML_TYPE_F32, dst, n);
+}
+
+static float dot_f32(const int n, const float * x, const float * y) {
+    // independent partial sums so the loop vectorizes
+    float sums[8] = {};
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            sums[j] += x[i + j]*y[i + j];
+        }
+    }
+    float sum = 0.0f;
+    for (; i < n; i++) {
+        sum += x[i]*y[i];
+    }
+    for (int j = 0; j < 8; j++) {
+        sum += sums[j];
+    }
+    return sum;
+}
+
+// Computes softmax(Q*K/sqrt(d) + alibi + causal mask)*V of one layer for the N queries in q
+// Keys and values are processed in tiles with an online softmax, so the attention matrix is never materialized
+// and every cache row is read once per head no matter how many queries are evaluated
+static void mpt_attention(
+        const mpt_model & model,
+        const mpt_kv_cache & kv,
+        const int il,
         const int n_threads,
         const int n_past,
-        const std::vector<int>           & embd_inp,
-              std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
+        const int N,
+        const struct ggml_tensor * q,
+              struct ggml_tensor * out) {
+    const auto & hparams = model.hparams;
+
+    const int n_embd = hparams.n_embd;
+    const int n_ctx  = kv.n_ctx; // per layer stride of the KV cache
+    const int n_head = hparams.n_head;
+    const int d_head = n_embd/n_head;
+
+    constexpr int n_tile = 64;
+
+    const float scale = 1.0f/sqrtf(float(d_head));
+
+    // alibi slopes, same as ggml_alibi
+    const int n_heads_log2_floor = 1 << (int) floor(log2(n_head));
+    const float m0 = powf(2.0f, -hparams.alibi_bias_max / n_heads_log2_floor);
+    const float m1 = powf(2.0f, -hparams.alibi_bias_max / 2.0f / n_heads_log2_floor);
+
+    const float * Q = (const float *) q->data;
+    float * O = (float *) out->data;
+
+    // scratch space of a thread, kept across calls so it is only allocated when it has to grow
+    struct head_scratch {
+        std::vector<float> k_tile, v_tile, scores, acc, row_max, row_sum;
+    };
+
+    // heads are distributed over the calling thread and persistent workers of the shared compute pool
+    const int nth = std::min(n_threads, n_head);
+    LM::ComputePool::get().run_parallel(nth, [&] (unsigned ith, unsigned) {
+        thread_local head_scratch scratch;
+        auto & k_tile  = scratch.k_tile;
+        auto & v_tile  = scratch.v_tile;
+        auto & scores  = scratch.scores;
+        auto & acc     = scratch.acc;
+        auto & row_max = scratch.row_max;
+        auto & row_sum = scratch.row_sum;
+        k_tile.resize(n_tile*d_head);
+        v_tile.resize(n_tile*d_head);
+        scores.resize(n_tile);
+        acc.resize(N*d_head);
+        row_max.resize(N);
+        row_sum.resize(N);
+
+        for (int h = ith; h < n_head; h += nth) {
+            const float slope = h < n_heads_log2_floor ? powf(m0, h + 1) : powf(m1, 2*(h - n_heads_log2_floor) + 1);
+
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            std::fill(row_max.begin(), row_max.end(), -INFINITY);
+            std::fill(row_sum.begin(), row_sum.end(), 0.0f);
+
+            for (int j0 = 0; j0 < n_past + N; j0 += n_tile) {
+                const int j1 = std::min(j0 + n_tile, n_past + N);
+
+                // load tile of keys and values of this head
+                for (int j = j0; j < j1; j++) {
+                    const size_t offset = (size_t(il)*n_ctx + j)*n_embd + h*d_head;
+                    kv_to_f32(kv.k, offset, d_head, k_tile.data() + (j - j0)*d_head);
+                    kv_to_f32(kv.v, offset, d_head, v_tile.data() + (j - j0)*d_head);
+                }
+
+                // queries before the tile are masked entirely; later queries see more of it
+                for (int t = std::max(0, j0 - n_past); t < N; t++) {
+                    const int pos  = n_past + t;
+                    const int jend = std::min(j1, pos + 1);
+
+                    const float * qt = Q + t*n_embd + h*d_head;
+                    float * acct = acc.data() + t*d_head;
+
+                    // scaled scores with alibi bias relative to the query position
+                    float tile_max = -INFINITY;
+                    for (int j = j0; j < jend; j++) {
+                        const float s = dot_f32(d_head, k_tile.data() + (j - j0)*d_head, qt)*scale + slope*(j - pos);
+                        scores[j - j0] = s;
+                        tile_max = std::max(tile_max, s);
+                    }
+
+                    // rescale what was accumulated so far to the new maximum
+                    const float max_new = std::max(row_max[t], tile_max);
+                    const float correction = expf(row_max[t] - max_new);
+                    row_max[t] = max_new;
+                    row_sum[t] *= correction;
+                    for (int d = 0; d < d_head; d++) {
+                        acct[d] *= correction;
+                    }
+
+                    for (int j = j0; j < jend; j++) {
+                        const float p = expf(scores[j - j0] - max_new);
+                        row_sum[t] += p;
+                        const float * vj = v_tile.data() + (j - j0)*d_head;
+                        for (int d = 0; d < d_head; d++) {
+                            acct[d] += p*vj[d];
+                        }
+                    }
+                }
+            }
+
+            // normalize into the merged heads output
+            for (int t = 0; t < N; t++) {
+                const float inv_sum = 1.0f/row_sum[t];
+                float * ot = O + t*n_embd + h*d_head;
+                for (int d = 0; d < d_head; d++) {
+                    ot[d] = acc[t*d_head + d]*inv_sum;
+                }
+            }
+        }
+    });
+}
+
+// builds the graph evaluating embd_inp in graph.ctx; its tokens belong to seqs one after another
+static void mpt_build_graph(
+        const mpt_model & model,
+        mpt_graph & graph,
+        const std::vector<mpt_graph_seq> & seqs,
+        const std::vector<int> & embd_inp,
+        const g4a_logits_spec & logits = {}) {
     const int N = embd_inp.size();
 
     const auto & hparams = model.hparams;
 
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
-    const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
-
-    const size_t init_buf_size = 1024_MiB;
-    if (!model.buf.addr || model.buf.size < init_buf_size)
-        model.buf.resize(init_buf_size);
-
-    if (mem_per_token > 0 && mem_per_token*N > model.buf.size) {
-        const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        // printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, model.buf.size, buf_size_new);
-
-        // reallocate
-        model.buf.resize(buf_size_new);
-        if (model.buf.addr == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.buf.size);
-            return false;
-        }
-    }
 
-    struct ggml_init_params params = {
-        model.buf.size,
-        model.buf.addr,
-        false
-    };
+    struct ggml_context * ctx0 = graph.ctx;
 
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph gf{};
-    gf.n_threads = n_threads;
+    auto & gf  = graph.gf;
+    auto & ops = graph.ops;
+
+    graph.seqs = seqs;
 
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+    graph.embd = embd;
 
-    // wte
+    // wte; get_rows dequantizes the looked up rows if wte isn't F32
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, embd);
 
     for (int il = 0; il < n_layer; ++il) {
@@ -396,14 +700,11 @@ bool mpt_eval(
         {
 
             // norm1
-            cur = ggml_norm(ctx0, cur);
-            cur = ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].norm_1_w, cur),
-                    cur);
+            cur = g4a_norm_affine(ctx0, gf, ops, cur, model.layers[il].norm_1_w);
             // compute QKV
-            cur = ggml_mul_mat(ctx0,
+            cur = g4a_mul_mat(ctx0, gf, ops,
                     model.layers[il].attn_Wqkv_w,
-                    cur);
+                    cur, model.repacked);
 
             // TODO: clip_qkv
             struct ggml_tensor * Qcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 0*ggml_element_size(cur)*n_embd));
@@ -411,73 +712,56 @@ bool mpt_eval(
             struct ggml_tensor * Vcur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 2*ggml_element_size(cur)*n_embd));
 
             // TODO: qk_ln? (seems to be False in MPT-7B configs)
-            {
-                Vcur = ggml_transpose(ctx0, Vcur);
-
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, model.kv_self.v, N, n_embd,
-                                        (   n_ctx)*ggml_element_size(model.kv_self.v),
-                                        (il*n_ctx)*ggml_element_size(model.kv_self.v)*n_embd + n_past*ggml_element_size(model.kv_self.v));
+            // attention itself is computed by mpt_attention between the node ranges of the graph
+            ggml_build_forward_expand(&gf, Qcur);
+            cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+
+            // each sequence attends to its own cache only
+            int row = 0;
+            for (size_t s = 0; s < graph.seqs.size(); s++) {
+                const auto & seq = graph.seqs[s];
+                const auto & kv = *seq.kv;
+
+                // rows of the tokens of the sequence
+                const auto rows = [&] (struct ggml_tensor * t) {
+                    return graph.seqs.size() == 1 ? t : ggml_view_2d(ctx0, t, n_embd, seq.N, t->nb[1], row*t->nb[1]);
+                };
+                struct ggml_tensor * Qseq = rows(Qcur);
+                struct ggml_tensor * Oseq = rows(cur);
+
+                // store key and value to memory; both are stored by position so attention reads them row by row
+                {
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, kv.k, seq.N*n_embd, g4a_row_size(kv.k->type, n_embd*(size_t(il)*kv.n_ctx + seq.n_past)));
+                    struct ggml_tensor * v = ggml_view_1d(ctx0, kv.v, seq.N*n_embd, g4a_row_size(kv.v->type, n_embd*(size_t(il)*kv.n_ctx + seq.n_past)));
+
+                    // both may be quantized
+                    struct ggml_tensor * k_cpy = g4a_cpy(ctx0, gf, ops, rows(Kcur), k);
+                    struct ggml_tensor * v_cpy = g4a_cpy(ctx0, gf, ops, rows(Vcur), v);
+
+                    ggml_build_forward_expand(&gf, k_cpy);
+                    ggml_build_forward_expand(&gf, v_cpy);
+
+                    // new keys and values are stored at n_past, for reusing the graph
+                    if (graph.reusable) {
+                        graph.n_past_updates.push_back([&model, &kv, il, k, k_cpy, v, v_cpy] (int n_past) {
+                            const size_t offset = model.hparams.n_embd*(size_t(il)*kv.n_ctx + n_past);
+                            k_cpy->data = k->data = (char *) kv.k->data + g4a_row_size(kv.k->type, offset);
+                            v_cpy->data = v->data = (char *) kv.v->data + g4a_row_size(kv.v->type, offset);
+                        });
+                    }
+                }
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                g4a_graph_add_op(gf, ops, [&model, &graph, il, s, Qseq, Oseq] (int n_threads) {
+                    const auto & seq = graph.seqs[s];
+                    mpt_attention(model, *seq.kv, il, n_threads, seq.n_past, seq.N, Qseq, Oseq);
+                });
+                row += seq.N;
             }
-            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_embd/n_head, n_head, N),
-                        0, 2, 1, 3);
-
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.k)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctx0,
-                        KQ,
-                        ggml_new_f32(ctx0, 1.0f/sqrt(float(n_embd)/n_head))
-                        );
-
-
-            // Alibi
-            struct ggml_tensor * KQ_scaled_biased = ggml_alibi(ctx0, ggml_cont(ctx0, KQ_scaled), n_past, n_head);
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled_biased, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, model.kv_self.v,
-                        n_past + N, n_embd/n_head, n_head,
-                        n_ctx*ggml_element_size(model.kv_self.v),
-                        n_ctx*ggml_element_size(model.kv_self.v)*n_embd/n_head,
-                        il*n_ctx*ggml_element_size(model.kv_self.v)*n_embd);
-
-            // KQV = transpose(V) * KQ_soft_max
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
 
             // projection (no bias)
-            cur = ggml_mul_mat(ctx0,
+            cur = g4a_mul_mat(ctx0, gf, ops,
                     model.layers[il].attn_out_proj_w,
-                    cur);
+                    cur, model.repacked);
         }
 
 
@@ -487,18 +771,15 @@ bool mpt_eval(
         {
             cur = resSA;
             // norm2
-            cur = ggml_norm(ctx0, cur);
-            cur = ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.layers[il].norm_2_w, cur),
-                    cur);
+            cur = g4a_norm_affine(ctx0, gf, ops, cur, model.layers[il].norm_2_w);
             // ffn
-            cur = ggml_mul_mat(ctx0,
+            cur = g4a_mul_mat(ctx0, gf, ops,
                     model.layers[il].ffn_up_proj_w,
-                    cur);
+                    cur, model.repacked);
             cur = ggml_gelu(ctx0, cur);
-            cur = ggml_mul_mat(ctx0,
+            cur = g4a_mul_mat(ctx0, gf, ops,
                     model.layers[il].ffn_down_proj_w,
-                    cur);
+                    cur, model.repacked);
 
         }
 
@@ -507,31 +788,258 @@ bool mpt_eval(
     }
 
     struct ggml_tensor * out = inpL;
+    // only the last token of each sequence is projected onto the vocabulary unless the logits of all are requested
+    if (!logits.all_tokens && seqs.size() == 1 && N > 1) {
+        out = ggml_view_2d(ctx0, out, n_embd, 1, out->nb[1], (N - 1)*out->nb[1]);
+    } else if (!logits.all_tokens && seqs.size() > 1) {
+        struct ggml_tensor * last = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, seqs.size());
+        int row = 0;
+        for (size_t i = 0; i < seqs.size(); i++) {
+            row += seqs[i].N;
+            ((int32_t *) last->data)[i] = row - 1;
+        }
+        out = ggml_get_rows(ctx0, out, last);
+    }
     // -> logits
     {
-        out = ggml_norm(ctx0, out);
-        out = ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.norm_f_w, out),
-                    out);
-        out = ggml_mul_mat(ctx0, model.wte, out);
+        out = g4a_norm_affine(ctx0, gf, ops, out, model.norm_f_w);
+        // wte is never repacked, as the embedding lookup reads it too
+        if (logits.tokens.empty()) {
+            out = g4a_mul_mat(ctx0, gf, ops, model.wte, out, false);
+        } else {
+            out = g4a_mul_mat_rows(ctx0, gf, ops, model.wte, logits.tokens, out, false);
+        }
+    }
+
+    ggml_build_forward_expand(&gf, out);
+    graph.logits = out;
+}
+
+// builds the graph evaluating embd_inp after n_past tokens in the cache of the model in graph.ctx
+static void mpt_build_graph(
+        const mpt_model & model,
+        mpt_graph & graph,
+        const int n_past,
+        const std::vector<int> & embd_inp,
+        const g4a_logits_spec & logits = {}) {
+    mpt_build_graph(model, graph, {{&model.kv_self, n_past, int(embd_inp.size())}}, embd_inp, logits);
+}
+
+// returns the size of the compute buffer evaluating N tokens needs at most, computing the logits of all of them
+// if all_logits is set; logits of a subset of the vocabulary need less
+// measured once per batch size by building the graph in a generously sized temporary buffer;
+// tensor data isn't written while building, so its pages are never touched
+size_t mpt_eval_buf_size(mpt_model & model, const int N, bool all_logits) {
+    auto & buf_size = model.eval_buf_sizes[{N, all_logits}];
+    if (buf_size) {
+        return buf_size;
     }
 
+    const auto & hparams = model.hparams;
+
+    buf_size = g4a_compute_buf_size(N, [&] (int n) {
+        // at most 32 activations of n_embd per token and layer; attention scores aren't materialized
+        const size_t bound = 16_MiB + size_t(n)*(size_t(hparams.n_layer)*32*hparams.n_embd + 2*hparams.n_vocab)*sizeof(float);
+        std::unique_ptr<uint8_t[]> buf(new uint8_t[bound]);
+
+        struct ggml_init_params params = {
+            bound,
+            buf.get(),
+            false
+        };
+
+        auto graph = std::make_unique<mpt_graph>();
+        graph->ctx = ggml_init(params);
+        mpt_build_graph(model, *graph, std::max(0, model.kv_self.n_ctx_max - n), std::vector<int>(n, 0), {all_logits});
+        return ggml_used_mem(graph->ctx);
+    });
+
+    return buf_size;
+}
+
+// returns the graph evaluating token after n_past tokens, built once and then adjusted in place
+static mpt_graph & mpt_decode_graph(mpt_model & model, const int n_past, const int token) {
+    auto & graph = model.decode_graph;
+
+    if (!graph) {
+        model.decode_buf.resize(mpt_eval_buf_size(model, 1));
+
+        struct ggml_init_params params = {
+            model.decode_buf.size,
+            model.decode_buf.addr,
+            false
+        };
+
+        graph = std::make_unique<mpt_graph>();
+        graph->ctx = ggml_init(params);
+        graph->reusable = true;
+        mpt_build_graph(model, *graph, n_past, {token});
+    }
+
+    graph->seqs[0].n_past = n_past;
+    for (const auto & update : graph->n_past_updates) {
+        update(n_past);
+    }
+    ((int32_t *) graph->embd->data)[0] = token;
+
+    return *graph;
+}
+
+bool mpt_eval(
+        mpt_model & model,
+        const int n_threads,
+        const int n_past,
+        const std::vector<int>           & embd_inp,
+              std::vector<float>         & embd_w,
+        const g4a_logits_spec            & logits) {
+    const int N = embd_inp.size();
+
+    const int n_vocab = model.hparams.n_vocab;
+
+    if (!g4a_logits_valid(logits, n_vocab)) {
+        return false;
+    }
+
+    if (N == 0 || n_past < 0 || n_past + N > model.kv_self.n_ctx_max) {
+        fprintf(stderr, "%s: %d tokens after %d don't fit into the cache\n", __func__, N, n_past);
+        return false;
+    }
+
+    // grow the KV cache if it has no room for the new tokens yet
+    if (!kv_cache_reserve(model, model.kv_self, n_past + N)) {
+        return false;
+    }
+
+    // single tokens reuse the decode graph of the model; batches, and single tokens whose logits are restricted
+    // to some tokens, are built in a buffer shared with other instances that aren't evaluating right now
+    std::unique_ptr<g4a_compute_buffer> buf;
+    std::unique_ptr<mpt_graph> batch_graph;
+    if (N != 1 || !logits.tokens.empty()) {
+        buf = std::make_unique<g4a_compute_buffer>(mpt_eval_buf_size(model, N, logits.all_tokens));
+
+        struct ggml_init_params params = {
+            buf->size(),
+            buf->addr(),
+            false
+        };
+
+        batch_graph = std::make_unique<mpt_graph>();
+        batch_graph->ctx = ggml_init(params);
+        mpt_build_graph(model, *batch_graph, n_past, embd_inp, logits);
+    }
+    auto & graph = batch_graph ? *batch_graph : mpt_decode_graph(model, n_past, embd_inp[0]);
 
     // run the computation
-    ggml_build_forward_expand(&gf, out);
-    ggml_graph_compute       (ctx0, &gf);
+    g4a_graph_compute(graph.ctx, graph.gf, graph.ops, n_threads);
+
+    model.kv_self.n = n_past + N;
+
 
+    // return result for the requested tokens, by default just the last one
+    const size_t n_logits = logits.tokens.empty() ? n_vocab : logits.tokens.size();
+    embd_w.resize(n_logits*(logits.all_tokens ? N : 1));
+    memcpy(embd_w.data(), ggml_get_data(graph.logits), sizeof(float)*embd_w.size());
+
+    //printf("used_mem = %zu\n", ggml_used_mem(graph.ctx));
+
+    return true;
+}
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(out) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
+// allocates an empty cache for another sequence of model, of the same type and size limits as the model's own one
+bool mpt_kv_cache_shrink(mpt_model & model) {
+    auto & kv_self = model.kv_self;
+    if (!kv_self.n_chunk) {
+        return true;
+    }
+
+    const int n_ctx = std::min(kv_self.n_chunk, kv_self.n_ctx_max);
+    kv_self.n = std::min(kv_self.n, n_ctx);
+    return kv_self.n_ctx <= n_ctx || kv_cache_resize(model, kv_self, n_ctx);
+}
+
+bool mpt_kv_cache_create(const mpt_model & model, mpt_kv_cache & cache) {
+    const auto & kv_self = model.kv_self;
+
+    cache.n_ctx_max = kv_self.n_ctx_max;
+    cache.n_chunk   = kv_self.n_chunk;
+
+    return kv_cache_init(model.hparams, cache, kv_self.k->type, cache.n_chunk ? std::min(cache.n_chunk, cache.n_ctx_max) : cache.n_ctx_max);
+}
+
+// evaluates the tokens of several sequences at once, each attending to its own KV cache only
+// the weights are read once for all of them, which is what limits decoding single tokens
+// each sequence gets the logits of its last token, or of all its tokens if logits.all_tokens is set
+bool mpt_eval_sequences(
+        mpt_model & model,
+        const int n_threads,
+        std::vector<mpt_sequence> & seqs,
+        const g4a_logits_spec & logits) {
+    const int n_vocab = model.hparams.n_vocab;
+    const int n_layer = model.hparams.n_layer;
+
+    if (!g4a_logits_valid(logits, n_vocab)) {
+        return false;
+    }
+
+    // gather the tokens of all sequences, making room for them in their caches
+    std::vector<mpt_graph_seq> graph_seqs;
+    std::vector<int> embd_inp;
+    for (auto & seq : seqs) {
+        auto & kv = seq.kv ? *seq.kv : model.kv_self;
+
+        const int N = seq.tokens.size();
+        if (N == 0 || seq.n_past < 0 || seq.n_past + N > kv.n_ctx_max) {
+            fprintf(stderr, "%s: %d tokens after %d don't fit into the cache of their sequence\n", __func__, N, seq.n_past);
+            return false;
+        }
+        for (const auto & other : graph_seqs) {
+            if (other.kv == &kv) {
+                fprintf(stderr, "%s: sequences can't share a cache\n", __func__);
+                return false;
+            }
+        }
+        if (!kv_cache_reserve(model, kv, seq.n_past + N)) {
+            return false;
+        }
+
+        graph_seqs.push_back({&kv, seq.n_past, N});
+        embd_inp.insert(embd_inp.end(), seq.tokens.begin(), seq.tokens.end());
+    }
+    if (graph_seqs.empty()) {
+        return true;
     }
-    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
-    ggml_free(ctx0);
+    const int N = embd_inp.size();
+
+    // the graph is at most as large as the one of a single sequence of all tokens with the logits of all of them,
+    // plus the tensors each further sequence adds: the 4 views of its rows and the cache views and copies storing them
+    constexpr size_t n_seq_tensors = 4 + 4;
+    g4a_compute_buffer buf(mpt_eval_buf_size(model, N, true) + graph_seqs.size()*n_layer*n_seq_tensors*g4a_tensor_overhead);
+
+    struct ggml_init_params params = {
+        buf.size(),
+        buf.addr(),
+        false
+    };
+
+    mpt_graph graph;
+    graph.ctx = ggml_init(params);
+    mpt_build_graph(model, graph, graph_seqs, embd_inp, logits);
+
+    // run the computation
+    g4a_graph_compute(graph.ctx, graph.gf, graph.ops, n_threads);
+
+    // return results by sequence
+    const size_t n_logits = logits.tokens.empty() ? n_vocab : logits.tokens.size();
+    const float * out = (const float *) ggml_get_data(graph.logits);
+    for (size_t i = 0; i < seqs.size(); i++) {
+        auto & seq = seqs[i];
+        (seq.kv ? *seq.kv : model.kv_self).n = seq.n_past + graph_seqs[i].N;
+
+        seq.logits.assign(out, out + n_logits*(logits.all_tokens ? graph_seqs[i].N : 1));
+        out += seq.logits.size();
+    }
 
     return true;
 }
@@ -539,16 +1047,79 @@ bool mpt_eval(
 
 #define MPT_MAX_RNG_STATE 64*1024
 
+// states begin with these; ones saved before they had a version begin with the size of the rng state instead
+#define MPT_STATE_MAGIC   0x67736d70
+#define MPT_STATE_VERSION 1
+
+// size of the KV cache in states: the type of keys and values, then the keys and values of the cached tokens per layer
+// it doesn't depend on how many tokens the cache has room for, and states saved with another type are converted
+static size_t kv_state_size(const mpt_model & model) {
+    const auto & kv_self = model.kv_self;
+    return sizeof(int32_t) + 2u*model.hparams.n_layer*g4a_row_size(kv_self.k->type, size_t(kv_self.n)*model.hparams.n_embd);
+}
+
+// returns true if the KV cache can be stored as given type
+static bool kv_type_valid(int32_t type) {
+    return type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || type == GGML_TYPE_Q8_0;
+}
+
+// restores the KV cache from a state saved before it had a version, which stored the whole F16 cache buffer: a ggml
+// context with the keys, then the values, of as many tokens per layer as the buffer had room for
+static bool set_legacy_kv_data(mpt_model & model, const uint8_t * in, size_t size, size_t kv_size, int kv_ntok) {
+    auto & kv_self = model.kv_self;
+    const int n_embd  = model.hparams.n_embd;
+    const int n_layer = model.hparams.n_layer;
+
+    const size_t ctx_size = 2*size_t(n_layer)*n_embd*sizeof(ggml_fp16_t);
+    if (kv_size > size || kv_size < 2_MiB || (kv_size - 2_MiB) % ctx_size != 0) {
+        fprintf(stderr, "%s: kv cache has wrong size in state: got %zu\n", __func__, kv_size);
+        return false;
+    }
+    const size_t n_ctx = (kv_size - 2_MiB)/ctx_size;
+    if (kv_ntok < 0 || size_t(kv_ntok) > n_ctx || kv_ntok > kv_self.n_ctx_max) {
+        fprintf(stderr, "%s: %d tokens don't fit into the cache\n", __func__, kv_ntok);
+        return false;
+    }
+
+    // a growable cache may need more room first
+    if (!kv_cache_reserve(model, kv_self, kv_ntok) || kv_ntok > kv_self.n_ctx) {
+        fprintf(stderr, "%s: failed to grow the kv cache to %d tokens\n", __func__, kv_ntok);
+        return false;
+    }
+
+    // the data of each tensor follows its object header and the tensor itself and is padded to 16 bytes
+    const size_t tensor_size = n_ctx*n_layer*n_embd*sizeof(ggml_fp16_t);
+    const uint8_t * k_data = in + g4a_object_size + sizeof(struct ggml_tensor);
+    const uint8_t * v_data = k_data + (tensor_size + 15)/16*16 + g4a_object_size + sizeof(struct ggml_tensor);
+
+    // the state may not be aligned for F16 values, so layers are copied out first
+    std::vector<ggml_fp16_t> layer(size_t(kv_ntok)*n_embd);
+
+    for (int il = 0; il < n_layer; il++) {
+        for (const auto & [data, kv] : {std::make_pair(k_data, kv_self.k), std::make_pair(v_data, kv_self.v)}) {
+            memcpy(layer.data(), data + sizeof(ggml_fp16_t)*il*n_ctx*n_embd, sizeof(ggml_fp16_t)*layer.size());
+            g4a_convert_row(GGML_TYPE_F16, layer.data(), kv->type, (char *) kv->data + g4a_row_size(kv->type, size_t(il)*kv_self.n_ctx*n_embd), layer.size());
+        }
+    }
+
+    kv_self.n = kv_ntok;
+    return true;
+}
+
 size_t mpt_get_state_size(const mpt_model &model)
 {
     // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
     // for reference, std::mt19937(1337) serializes to 6701 bytes.
+    const size_t s_magic           = sizeof(uint32_t);
+    const size_t s_version         = sizeof(uint32_t);
     const size_t s_rng_size        = sizeof(size_t);
     const size_t s_rng             = MPT_MAX_RNG_STATE;
     const size_t s_kv_size         = sizeof(size_t);
     const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
+    const size_t s_kv              = kv_state_size(model);
     const size_t s_total = (
+        + s_magic
+        + s_version
         + s_rng_size
         + s_rng
         + s_kv_size
@@ -563,6 +1134,14 @@ size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937 &rng, uint
 {
     uint8_t * out = dest;
     fflush(stdout);
+    // copy layout version
+    {
+        const uint32_t magic   = MPT_STATE_MAGIC;
+        const uint32_t version = MPT_STATE_VERSION;
+        memcpy(out, &magic,   sizeof(magic));   out += sizeof(magic);
+        memcpy(out, &version, sizeof(version)); out += sizeof(version);
+    }
+
     // copy rng
     {
         std::stringstream rng_ss;
@@ -580,14 +1159,25 @@ size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937 &rng, uint
 
     // copy kv cache
     {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
+        const auto & kv_self = model.kv_self;
+
+        const size_t kv_size = kv_state_size(model);
+        const int    kv_ntok = kv_self.n;
 
         memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
         memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
 
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
+        const int32_t type = kv_self.k->type;
+        memcpy(out, &type, sizeof(type)); out += sizeof(type);
+
+        const int n_embd = model.hparams.n_embd;
+        const size_t layer_size = g4a_row_size(kv_self.k->type, size_t(kv_ntok)*n_embd);
+
+        // keys and values of the cached tokens
+        for (int il = 0; il < model.hparams.n_layer; il++) {
+            for (const auto kv : {kv_self.k, kv_self.v}) {
+                memcpy(out, (char *) kv->data + g4a_row_size(kv->type, size_t(il)*kv_self.n_ctx*n_embd), layer_size); out += layer_size;
+            }
         }
     }
 
@@ -596,9 +1186,40 @@ size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937 &rng, uint
     return written;
 }
 
-size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src)
+size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src, size_t size)
 {
     const uint8_t * in = src;
+    const uint8_t * end = src + size;
+
+    // the fixed size part from the rng up to the number of cached tokens
+    const size_t s_header = sizeof(size_t) + MPT_MAX_RNG_STATE + sizeof(size_t) + sizeof(int);
+    if (size < s_header) {
+        fprintf(stderr, "%s: state is truncated\n", __func__);
+        return 0;
+    }
+
+    // check layout version; states without one are converted
+    uint32_t version = 0;
+    {
+        uint32_t magic;
+        memcpy(&magic, in, sizeof(magic));
+
+        if (magic == MPT_STATE_MAGIC) {
+            in += sizeof(magic);
+            memcpy(&version, in, sizeof(version)); in += sizeof(version);
+
+            if (version != MPT_STATE_VERSION) {
+                fprintf(stderr, "%s: state was saved by an incompatible version\n", __func__);
+                return 0;
+            }
+        }
+
+        // followed by the type of the kv cache since version 1
+        if (size_t(end - in) < s_header + (version == MPT_STATE_VERSION ? sizeof(int32_t) : 0)) {
+            fprintf(stderr, "%s: state is truncated\n", __func__);
+            return 0;
+        }
+    }
 
     // set rng
     {
@@ -608,11 +1229,21 @@ size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *sr
         memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
         memcpy(&rng_buf[0], in, MPT_MAX_RNG_STATE); in += MPT_MAX_RNG_STATE;
 
+        if (rng_size > MPT_MAX_RNG_STATE) {
+            fprintf(stderr, "%s: invalid rng state\n", __func__);
+            return 0;
+        }
+
+        std::mt19937 rng_new;
         std::stringstream rng_ss;
         rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
+        rng_ss >> rng_new;
 
-        assert(rng_ss.fail() == false);
+        if (rng_ss.fail()) {
+            fprintf(stderr, "%s: invalid rng state\n", __func__);
+            return 0;
+        }
+        *rng = rng_new;
     }
 
     // set kv cache
@@ -623,20 +1254,50 @@ size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *sr
         memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
         memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
 
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
+        if (version < MPT_STATE_VERSION) {
+            if (!set_legacy_kv_data(*model, in, end - in, kv_size, kv_ntok)) {
+                return 0;
+            }
+            in += kv_size;
+        } else {
+            int32_t type;
+            memcpy(&type, in, sizeof(type)); in += sizeof(type);
+
+            auto & kv_self = model->kv_self;
+            const int n_embd = model->hparams.n_embd;
+
+            if (!kv_type_valid(type) || n_embd % ggml_blck_size(ggml_type(type)) != 0) {
+                fprintf(stderr, "%s: unsupported kv cache type %d\n", __func__, type);
+                return 0;
+            }
+            if (kv_ntok < 0 || kv_ntok > kv_self.n_ctx_max) {
+                fprintf(stderr, "%s: %d tokens don't fit into the cache\n", __func__, kv_ntok);
+                return 0;
+            }
+
+            const size_t kv_size_expected = sizeof(int32_t) + 2u*model->hparams.n_layer*g4a_row_size(ggml_type(type), size_t(kv_ntok)*n_embd);
+            if (kv_size != kv_size_expected || kv_size - sizeof(int32_t) > size_t(end - in)) {
+                fprintf(stderr, "%s: kv cache has wrong size in state: got %zu, expected %zu\n", __func__, kv_size, kv_size_expected);
+                return 0;
+            }
 
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
+            // a growable cache may need more room first
+            if (!kv_cache_reserve(*model, kv_self, kv_ntok) || kv_ntok > kv_self.n_ctx) {
+                fprintf(stderr, "%s: failed to grow the kv cache to %d tokens\n", __func__, kv_ntok);
+                return 0;
+            }
 
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
+            const size_t layer_size = g4a_row_size(ggml_type(type), size_t(kv_ntok)*n_embd);
 
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
+            for (int il = 0; il < model->hparams.n_layer; il++) {
+                for (const auto kv : {kv_self.k, kv_self.v}) {
+                    g4a_convert_row(ggml_type(type), in, kv->type, (char *) kv->data + g4a_row_size(kv->type, size_t(il)*kv_self.n_ctx*n_embd), size_t(kv_ntok)*n_embd);
+                    in += layer_size;
+                }
+            }
 
+            kv_self.n = kv_ntok;
         }
-
-        model->kv_self.n = kv_ntok;
     }
 
     const size_t nread    = in - src;
@@ -1,11 +1,14 @@
 #ifndef MPT_H
 #define MPT_H
 #include "../g4a_common.hpp"
+#include "../g4a_ops.hpp"
 
 #include <string>
 #include <vector>
 #include <map>
 #include <random>
+#include <memory>
+#include <functional>
 #include <ggml.h>
 
 
@@ -60,7 +63,11 @@ struct mpt_kv_cache {
 
     mpt_buffer buf;
 
-    int n; // number of tokens currently in the cache
+    int n = 0; // number of tokens currently in the cache
+
+    int n_ctx     = 0; // number of tokens per layer there is room for
+    int n_ctx_max = 0; // number of tokens per layer it may grow to
+    int n_chunk   = 0; // number of tokens it grows by at once; 0 if it's allocated for n_ctx_max up front
 
     ~mpt_kv_cache() {
         if (ctx) {
@@ -69,6 +76,38 @@ struct mpt_kv_cache {
     }
 };
 
+// tokens of one sequence in a graph; they attend to the cache of their sequence only
+struct mpt_graph_seq {
+    const mpt_kv_cache * kv;
+    int n_past;
+    int N;
+};
+
+// graph of one evaluation
+struct mpt_graph {
+    struct ggml_context * ctx = NULL; // context the graph is built in
+
+    struct ggml_cgraph gf = {};
+
+    // work computed outside of ggml in between the graph nodes
+    g4a_graph_ops ops;
+
+    std::vector<mpt_graph_seq> seqs; // read by the attention ops when they are computed
+
+    struct ggml_tensor * embd   = nullptr;
+    struct ggml_tensor * logits = nullptr;
+
+    // adjustments of the tensors depending on n_past, recorded if the graph is built to be reused
+    bool reusable = false;
+    std::vector<std::function<void (int n_past)>> n_past_updates;
+
+    ~mpt_graph() {
+        if (ctx) {
+            ggml_free(ctx);
+        }
+    }
+};
+
 struct mpt_model {
     mpt_hparams hparams;
 
@@ -81,23 +120,52 @@ struct mpt_model {
 
     std::vector<mpt_layer> layers;
 
+    bool repacked = false; // quantized weights were rearranged by g4a_repack where supported
+
     struct mpt_kv_cache kv_self;
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
 
-    mpt_buffer buf;
+    mpt_buffer weights_buf; // memory of ctx, holding the weights that are read
+
+    std::unique_ptr<g4a_mmap> mapping; // model file, if weights point into it
+    struct ggml_context * ctx_mapped = NULL; // headers of the mapped weights
+
+    std::map<std::pair<int, bool>, size_t> eval_buf_sizes; // compute buffer size by batch size and whether all logits are computed, measured on first use
+
+    // graph evaluating single tokens, built on first use and adjusted to n_past for every token
+    mpt_buffer decode_buf;
+    std::unique_ptr<mpt_graph> decode_graph;
 
     ~mpt_model() {
         if (ctx) {
             ggml_free(ctx);
         }
+        if (ctx_mapped) {
+            ggml_free(ctx_mapped);
+        }
     }
 };
 
 
-bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab& vocab);
-bool mpt_eval(mpt_model& model, const int n_threads, const int n_past, const std::vector<int>& embd_inp, std::vector<float>& embd_w, size_t& mem_per_token);
+bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab& vocab, int n_ctx = 0, int n_ctx_chunk = 0, ggml_type kv_type = GGML_TYPE_F16, const g4a_mmap_params & mmap_params = {}, const g4a_load_progress & progress = nullptr);
+size_t mpt_eval_buf_size(mpt_model& model, const int N, bool all_logits = false);
+bool mpt_eval(mpt_model& model, const int n_threads, const int n_past, const std::vector<int>& embd_inp, std::vector<float>& embd_w, const g4a_logits_spec& logits = {});
+
+// one sequence of mpt_eval_sequences
+struct mpt_sequence {
+    mpt_kv_cache * kv = nullptr; // cache of the sequence, e.g. from mpt_kv_cache_create; the one of the model if null
+    int n_past = 0; // tokens already in kv
+    std::vector<int> tokens; // tokens to evaluate after them
+    std::vector<float> logits; // set to the logits of the last token, or of all tokens if requested
+};
+
+bool mpt_kv_cache_create(const mpt_model& model, mpt_kv_cache& cache);
+// shrinks the model's own cache back to room for one chunk of tokens if it is growable, dropping the tokens beyond
+bool mpt_kv_cache_shrink(mpt_model& model);
+bool mpt_eval_sequences(mpt_model& model, const int n_threads, std::vector<mpt_sequence>& seqs, const g4a_logits_spec& logits = {});
 size_t mpt_get_state_size(const mpt_model &model);
 size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937& rng, uint8_t *dest);
-size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src);
+// returns the number of bytes read from src, or 0 if the size bytes at src aren't a state model can take
+size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src, size_t size);
 #endif // MPT_H
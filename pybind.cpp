@@ -1,5 +1,6 @@
 #include "justlm.hpp"
 #include "justlm_pool.hpp"
+#include "justlm_compute.hpp"
 
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
@@ -11,13 +12,22 @@ namespace py = pybind11;
 
 PYBIND11_MODULE(justlm_py, m) {
     using namespace LM;
+    py::enum_<Inference::KVType>(m, "KVType")
+        .value("F32", Inference::KVType::F32)
+        .value("F16", Inference::KVType::F16)
+        .value("Q8", Inference::KVType::Q8);
     py::class_<Inference::Params>(m, "Params")
         .def(py::init<>())
         .def_readonly("seed", &Inference::Params::seed)
         .def_readwrite("n_threads", &Inference::Params::n_threads)
+        .def_readwrite("n_threads_batch", &Inference::Params::n_threads_batch)
+        .def_readwrite("n_threads_autotune", &Inference::Params::n_threads_autotune)
         .def_readwrite("n_ctx", &Inference::Params::n_ctx)
+        .def_readwrite("n_ctx_chunk", &Inference::Params::n_ctx_chunk)
+        .def_readwrite("kv_type", &Inference::Params::kv_type)
         .def_readwrite("n_ctx_window_top_bar", &Inference::Params::n_ctx_window_top_bar)
         .def_readwrite("n_batch", &Inference::Params::n_batch)
+        .def_readwrite("n_batch_autotune", &Inference::Params::n_batch_autotune)
         .def_readwrite("n_repeat_last", &Inference::Params::n_repeat_last)
         .def_readwrite("repeat_penalty", &Inference::Params::repeat_penalty)
         .def_readwrite("top_k", &Inference::Params::top_k)
@@ -25,12 +35,17 @@ PYBIND11_MODULE(justlm_py, m) {
         .def_readwrite("temp", &Inference::Params::temp)
         .def_readwrite("repeat_penalty", &Inference::Params::repeat_penalty)
         .def_readwrite("eos_ignores", &Inference::Params::n_eos_ignores)
+        .def_readwrite("numa_node", &Inference::Params::numa_node)
+        .def_readwrite("use_mmap", &Inference::Params::use_mmap)
+        .def_readwrite("mmap_populate", &Inference::Params::mmap_populate)
         .def_readwrite("use_mlock", &Inference::Params::use_mlock)
+        .def_readwrite("parallel_branches", &Inference::Params::parallel_branches)
         .def_readwrite("prefer_mirostat", &Inference::Params::prefer_mirostat)
         .def_readwrite("mirostat_learning_rate", &Inference::Params::mirostat_learning_rate)
         .def_readwrite("mirostat_target_entropy", &Inference::Params::mirostat_target_entropy);
     py::class_<Inference>(m, "Inference")
-        .def_static("construct", &Inference::construct, py::arg("weights_path"), py::arg("params") = Inference::Params())
+        .def_static("construct", &Inference::construct, py::arg("weights_path"), py::arg("params") = Inference::Params(), py::arg("on_progress") = nullptr, py::call_guard<py::gil_scoped_release>())
+        .def_static("construct_async", &Inference::construct_async, py::arg("weights_path"), py::arg("params") = Inference::Params(), py::arg("on_progress") = nullptr)
         .def("append", &Inference::append, py::arg("prompt"), py::arg("on_tick") = nullptr)
         .def("run", &Inference::run, py::arg("end") = "", py::arg("on_tick") = nullptr, py::arg("pre_tick") = nullptr)
         .def("create_savestate", &Inference::create_savestate)
@@ -44,6 +59,17 @@ PYBIND11_MODULE(justlm_py, m) {
         .def_readwrite("params", &Inference::params);
     py::class_<Inference::Savestate>(m, "Savestate")
         .def(py::init<>());
+    py::class_<AsyncConstruction>(m, "AsyncConstruction")
+        .def("get_progress", &AsyncConstruction::get_progress)
+        .def("cancel", &AsyncConstruction::cancel)
+        .def("is_ready", &AsyncConstruction::is_ready)
+        .def("get", &AsyncConstruction::get, py::call_guard<py::gil_scoped_release>());
+
+    py::class_<ComputePool, std::unique_ptr<ComputePool, py::nodelete>>(m, "ComputePool")
+        .def_static("get", &ComputePool::get, py::return_value_policy::reference)
+        .def("set_thread_limit", &ComputePool::set_thread_limit, py::arg("n_threads"))
+        .def("get_thread_limit", &ComputePool::get_thread_limit)
+        .def("get_worker_count", &ComputePool::get_worker_count);
 
     py::class_<InferencePool>(m, "InferencePool")
         .def(py::init<size_t, const std::string&, bool>(), py::arg("size"), py::arg("pool_name"), py::arg("clean_up") = true)
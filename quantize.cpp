@@ -0,0 +1,328 @@
+// Quantizes GPT-J and MPT model files in the ggml formats read by gptj_model_load and mpt_model_load
+
+#include "g4a_ops.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <regex>
+#include <thread>
+#include <algorithm>
+#include <ggml.h>
+
+
+
+struct type_override {
+    std::regex pattern;
+    ggml_type type;
+};
+
+struct quantize_stats {
+    size_t size_in  = 0;
+    size_t size_out = 0;
+    double sum_sq_error = 0.0;
+    float max_error = 0.0f;
+    size_t n_elements = 0;
+};
+
+static ggml_type parse_type(const std::string & name) {
+    for (int i = 0; i != GGML_TYPE_COUNT; i++) {
+        const auto type = ggml_type(i);
+        if (g4a_type_to_ftype(type) >= 0 && name == ggml_type_name(type)) {
+            return type;
+        }
+    }
+    return GGML_TYPE_COUNT;
+}
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s model-in.bin model-out.bin type [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  type                  f32, f16, q4_0, q4_1, q4_2, q5_0, q5_1 or q8_0\n");
+    fprintf(stderr, "  -t N                  number of threads to quantize with (default: all)\n");
+    fprintf(stderr, "  -o REGEX=TYPE         store tensors whose name matches REGEX as TYPE instead, e.g. \"lm_head.weight=f16\"\n");
+    fprintf(stderr, "                        may be given multiple times; the first match wins\n");
+}
+
+// Runs fnc(first_row, n_rows) for all rows split across n_threads threads
+template<typename Fnc>
+static void parallel_rows(int64_t n_rows, int n_threads, const Fnc & fnc) {
+    const int64_t n_per_thread = (n_rows + n_threads - 1)/n_threads;
+    std::vector<std::thread> workers;
+    for (int64_t first = n_per_thread; first < n_rows; first += n_per_thread) {
+        workers.emplace_back(fnc, first, std::min(n_per_thread, n_rows - first));
+    }
+    fnc(0, std::min(n_per_thread, n_rows));
+    for (auto & worker : workers) {
+        worker.join();
+    }
+}
+
+// Converts n_rows rows of n_per_row F32 values to given type
+// Returns the size of the result and accumulates the round trip error into stats
+static size_t convert_tensor(const float * src, std::vector<uint8_t> & dst, ggml_type type, int64_t n_rows, int64_t n_per_row, int n_threads, quantize_stats & stats) {
+    const size_t row_size = n_per_row*ggml_type_size(type)/ggml_blck_size(type);
+    dst.resize(n_rows*row_size);
+
+    std::vector<double> thread_sq_error(n_rows);
+    std::vector<float> thread_max_error(n_rows);
+
+    parallel_rows(n_rows, n_threads, [&] (int64_t first, int64_t count) {
+        std::vector<float> restored(n_per_row);
+        double sum_sq_error = 0.0;
+        float max_error = 0.0f;
+        for (int64_t row = first; row != first + count; row++) {
+            const float * in = src + row*n_per_row;
+            uint8_t * out = dst.data() + row*row_size;
+            // Convert row and convert it back for the error statistics
+            switch (type) {
+                case GGML_TYPE_F32: {
+                    memcpy(out, in, row_size);
+                    memcpy(restored.data(), in, row_size);
+                } break;
+                case GGML_TYPE_F16: {
+                    ggml_fp32_to_fp16_row(in, reinterpret_cast<ggml_fp16_t *>(out), n_per_row);
+                    ggml_fp16_to_fp32_row(reinterpret_cast<ggml_fp16_t *>(out), restored.data(), n_per_row);
+                } break;
+                default: {
+                    int64_t hist[16] = {};
+                    ggml_quantize_chunk(type, in, out, 0, n_per_row, hist);
+                    ggml_internal_get_quantize_fn(type).dequantize_row_q(out, restored.data(), n_per_row);
+                }
+            }
+            for (int64_t i = 0; i != n_per_row; i++) {
+                const float error = std::fabs(restored[i] - in[i]);
+                sum_sq_error += double(error)*error;
+                max_error = std::max(max_error, error);
+            }
+        }
+        thread_sq_error[first] = sum_sq_error;
+        thread_max_error[first] = max_error;
+    });
+
+    for (int64_t row = 0; row != n_rows; row++) {
+        stats.sum_sq_error += thread_sq_error[row];
+        stats.max_error = std::max(stats.max_error, thread_max_error[row]);
+    }
+    stats.n_elements += n_rows*n_per_row;
+    return dst.size();
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 4) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const std::string fname_inp = argv[1];
+    const std::string fname_out = argv[2];
+
+    const ggml_type default_type = parse_type(argv[3]);
+    if (default_type == GGML_TYPE_COUNT) {
+        fprintf(stderr, "%s: invalid type '%s'\n", __func__, argv[3]);
+        return 1;
+    }
+
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<type_override> overrides;
+    for (int i = 4; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc) {
+            n_threads = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-o" && i + 1 < argc) {
+            const std::string value = argv[++i];
+            const auto eq = value.rfind('=');
+            const ggml_type type = eq == value.npos ? GGML_TYPE_COUNT : parse_type(value.substr(eq + 1));
+            if (type == GGML_TYPE_COUNT) {
+                fprintf(stderr, "%s: invalid override '%s'\n", __func__, value.c_str());
+                return 1;
+            }
+            overrides.push_back({std::regex(value.substr(0, eq)), type});
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // needed to initialize f16 tables
+    {
+        struct ggml_init_params params = { 0, NULL, false };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    auto finp = std::ifstream(fname_inp, std::ios::binary);
+    if (!finp) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname_inp.c_str());
+        return 1;
+    }
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        return 1;
+    }
+
+    // verify magic
+    uint32_t magic = 0;
+    finp.read((char *) &magic, sizeof(magic));
+    const bool is_mpt = magic == 0x67676d6d;
+    if (magic != 0x67676d6c && !is_mpt) {
+        fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname_inp.c_str());
+        return 1;
+    }
+    fout.write((const char *) &magic, sizeof(magic));
+
+    // copy hparams; the file type is their last field in both formats
+    {
+        std::vector<char> hparams(is_mpt ? 32 : 28);
+        finp.read(hparams.data(), hparams.size());
+
+        int32_t ftype_inp;
+        memcpy(&ftype_inp, hparams.data() + hparams.size() - sizeof(int32_t), sizeof(int32_t));
+        const int32_t ftype_out = g4a_type_to_ftype(default_type);
+        memcpy(hparams.data() + hparams.size() - sizeof(int32_t), &ftype_out, sizeof(int32_t));
+
+        printf("%s: %s model, ftype %d -> %d\n", __func__, is_mpt ? "MPT" : "GPT-J", ftype_inp, ftype_out);
+
+        fout.write(hparams.data(), hparams.size());
+    }
+
+    // copy vocab
+    {
+        int32_t n_vocab = 0;
+        finp.read((char *) &n_vocab, sizeof(n_vocab));
+        fout.write((const char *) &n_vocab, sizeof(n_vocab));
+
+        std::string word;
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len;
+            finp.read((char *) &len, sizeof(len));
+            fout.write((const char *) &len, sizeof(len));
+
+            // MPT marks special tokens in the highest bit
+            word.resize(is_mpt ? len &~ (1u<<31) : len);
+            finp.read((char *) word.data(), word.size());
+            fout.write(word.data(), word.size());
+        }
+
+        if (!finp) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad vocab)\n", __func__, fname_inp.c_str());
+            return 1;
+        }
+    }
+
+    // convert tensors
+    quantize_stats total;
+    std::vector<uint8_t> data_inp;
+    std::vector<float> data_f32;
+    std::vector<uint8_t> data_out;
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        finp.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        finp.read(reinterpret_cast<char *>(&length), sizeof(length));
+        finp.read(reinterpret_cast<char *>(&ttype),  sizeof(ttype));
+
+        if (finp.eof()) {
+            break;
+        }
+
+        int32_t nelements = 1;
+        int32_t ne[2] = { 1, 1 };
+        for (int i = 0; i < n_dims && i < 2; ++i) {
+            finp.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+            nelements *= ne[i];
+        }
+
+        std::string name(std::max(length, 0), 0);
+        finp.read(&name[0], name.size());
+
+        if (!finp || n_dims < 1 || n_dims > 2 || !g4a_tensor_type_valid(ttype, ne[0])) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad tensor header)\n", __func__, fname_inp.c_str());
+            return 1;
+        }
+
+        const ggml_type type_inp = ggml_type(ttype);
+        data_inp.resize(nelements*ggml_type_size(type_inp)/ggml_blck_size(type_inp));
+        finp.read(reinterpret_cast<char *>(data_inp.data()), data_inp.size());
+
+        // only 2D weights are converted; MPT's wte is too, it is both the embedding and the output head there
+        // GPT-J's q, k and v projections are packed together on load, so they always follow q
+        ggml_type type_out = type_inp;
+        if (n_dims == 2 && (type_inp == GGML_TYPE_F32 || type_inp == GGML_TYPE_F16)) {
+            const std::string type_name = is_mpt ? name : std::regex_replace(name, std::regex("attn\\.[kv]_proj"), "attn.q_proj");
+            type_out = default_type;
+            for (const auto & override : overrides) {
+                if (std::regex_match(type_name, override.pattern)) {
+                    type_out = override.type;
+                    break;
+                }
+            }
+            if (ne[0] % ggml_blck_size(type_out) != 0) {
+                fprintf(stderr, "%s: row length of '%s' isn't a multiple of the %s block size, keeping %s\n",
+                        __func__, name.c_str(), ggml_type_name(type_out), ggml_type_name(type_inp));
+                type_out = type_inp;
+            }
+        }
+
+        quantize_stats stats;
+        stats.size_in = data_inp.size();
+        if (type_out == type_inp) {
+            data_out = data_inp;
+        } else {
+            // convert to F32 first
+            data_f32.resize(nelements);
+            if (type_inp == GGML_TYPE_F16) {
+                ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t *>(data_inp.data()), data_f32.data(), nelements);
+            } else {
+                memcpy(data_f32.data(), data_inp.data(), nelements*sizeof(float));
+            }
+            convert_tensor(data_f32.data(), data_out, type_out, ne[1], ne[0], n_threads, stats);
+        }
+        stats.size_out = data_out.size();
+
+        // write tensor
+        const int32_t ttype_out = type_out;
+        fout.write(reinterpret_cast<const char *>(&n_dims),    sizeof(n_dims));
+        fout.write(reinterpret_cast<const char *>(&length),    sizeof(length));
+        fout.write(reinterpret_cast<const char *>(&ttype_out), sizeof(ttype_out));
+        for (int i = 0; i < n_dims; ++i) {
+            fout.write(reinterpret_cast<const char *>(&ne[i]), sizeof(ne[i]));
+        }
+        fout.write(name.data(), name.size());
+        fout.write(reinterpret_cast<const char *>(data_out.data()), data_out.size());
+
+        printf("%48s - [%5d, %5d], %4s -> %4s, %8.2f MB -> %8.2f MB",
+               name.c_str(), ne[0], ne[1], ggml_type_name(type_inp), ggml_type_name(type_out),
+               stats.size_in/1024.0/1024.0, stats.size_out/1024.0/1024.0);
+        if (stats.n_elements) {
+            printf(", rmse = %.8f, max error = %.6f", std::sqrt(stats.sum_sq_error/stats.n_elements), stats.max_error);
+        }
+        printf("\n");
+
+        total.size_in += stats.size_in;
+        total.size_out += stats.size_out;
+        total.sum_sq_error += stats.sum_sq_error;
+        total.max_error = std::max(total.max_error, stats.max_error);
+        total.n_elements += stats.n_elements;
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out.c_str());
+        return 1;
+    }
+
+    printf("%s: model size = %8.2f MB -> %8.2f MB\n", __func__, total.size_in/1024.0/1024.0, total.size_out/1024.0/1024.0);
+    if (total.n_elements) {
+        printf("%s: converted weights rmse = %.8f, max error = %.6f\n", __func__, std::sqrt(total.sum_sq_error/total.n_elements), total.max_error);
+    }
+
+    return 0;
+}